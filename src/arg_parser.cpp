@@ -1,13 +1,15 @@
 #include <exception>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "arg_parser.h"
 
 namespace charon {
 
 arg_parser::arg_parser()
-: app_sig_("charon", "A bare-bones SFTP client")
+: app_sig_("charon", "A bare-bones SFTP client"),
+  control_(false)
 {
    this->app_sig_.add_positionial
    (
@@ -23,7 +25,32 @@ arg_parser::arg arg_parser::operator[](const std::string & name)
 
 bool arg_parser::parse(int argc, char ** argv)
 {
-   if (this->app_sig_.parse(argc, argv, false) != sk3l::app::app_signature::OK)
+   // Flags are pulled out ahead of app_signature, which only takes the
+   // positional endpoint.
+   std::vector<char *> args;
+   for (int i = 0; i < argc; ++i)
+   {
+      if (i > 0 && std::string(argv[i]) == "-C")
+      {
+         this->control_ = true;
+         continue;
+      }
+
+      if (i > 0 && std::string(argv[i]) == "-b")
+      {
+         if (++i == argc)
+         {
+            std::cerr << "Option -b requires a script file" << std::endl;
+            this->app_sig_.print_usage();
+            return false;
+         }
+         this->batch_file_ = argv[i];
+         continue;
+      }
+      args.push_back(argv[i]);
+   }
+
+   if (this->app_sig_.parse(static_cast<int>(args.size()), args.data(), false) != sk3l::app::app_signature::OK)
    {
       this->app_sig_.print_usage();
       return false;
@@ -13,6 +13,8 @@ namespace charon {
    {
       private :
          sk3l::app::app_signature app_sig_;
+         std::string              batch_file_;
+         bool                     control_;
 
       public :
 
@@ -25,7 +27,12 @@ namespace charon {
          bool parse(int argc, char ** argv);
          void print_usage() const;
 
-         
+         // Script named with -b, or empty when none was given.
+         const std::string & batch_file() const {return this->batch_file_;}
+
+         // -C: run through the endpoint's control daemon, starting it if
+         // it isn't up.
+         bool control() const {return this->control_;}
    };
 }
 
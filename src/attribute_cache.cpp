@@ -0,0 +1,183 @@
+#include <iterator>
+
+#include "attribute_cache.h"
+
+namespace charon {
+
+attribute_cache::attribute_cache(int ttl_secs)
+   : ttl_(ttl_secs)
+{
+}
+
+void attribute_cache::set_ttl(int secs)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   this->ttl_ = (secs > 0) ? secs : 0;
+   if (this->ttl_ == 0)
+   {
+      this->attrs_.clear();
+      this->paths_.clear();
+   }
+}
+
+std::string attribute_cache::parent(const std::string & path)
+{
+   auto slash = path.find_last_of('/');
+   if (slash == std::string::npos)
+      return std::string();
+   return (slash == 0) ? std::string("/") : path.substr(0, slash);
+}
+
+bool attribute_cache::fresh(clock::time_point at, clock::time_point now) const
+{
+   return now - at < std::chrono::seconds(this->ttl_);
+}
+
+void attribute_cache::make_room(clock::time_point now)
+{
+   if (this->attrs_.size() + this->paths_.size() < MAX_ENTRIES)
+      return;
+
+   for (auto it = this->attrs_.begin(); it != this->attrs_.end(); )
+      it = this->fresh(it->second.at_, now) ? std::next(it) : this->attrs_.erase(it);
+   for (auto it = this->paths_.begin(); it != this->paths_.end(); )
+      it = this->fresh(it->second.at_, now) ? std::next(it) : this->paths_.erase(it);
+
+   // Everything still fresh: start over rather than track recency.
+   if (this->attrs_.size() + this->paths_.size() >= MAX_ENTRIES)
+   {
+      this->attrs_.clear();
+      this->paths_.clear();
+   }
+}
+
+attribute_cache::lookup_result attribute_cache::lookup
+(
+   const std::string & user,
+   const std::string & path,
+   sftp_file & attrs
+)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+
+   auto it = this->attrs_.find(path);
+   if (it == this->attrs_.end() || it->second.user_ != user)
+      return MISS;
+
+   if (!this->fresh(it->second.at_, clock::now()))
+   {
+      this->attrs_.erase(it);
+      return MISS;
+   }
+
+   if (!it->second.exists_)
+      return ABSENT;
+
+   attrs = it->second.attrs_;
+   return PRESENT;
+}
+
+void attribute_cache::store(const std::string & user, const std::string & path, const sftp_file & attrs)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   if (this->ttl_ == 0)
+      return;
+
+   auto now = clock::now();
+   this->make_room(now);
+
+   attr_entry & entry = this->attrs_[path];
+   entry.user_   = user;
+   entry.exists_ = true;
+   entry.attrs_  = attrs;
+   entry.at_     = now;
+}
+
+void attribute_cache::store_absent(const std::string & user, const std::string & path)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   if (this->ttl_ == 0)
+      return;
+
+   auto now = clock::now();
+   this->make_room(now);
+
+   attr_entry & entry = this->attrs_[path];
+   entry.user_   = user;
+   entry.exists_ = false;
+   entry.attrs_  = sftp_file();
+   entry.at_     = now;
+}
+
+bool attribute_cache::lookup_path(const std::string & user, const std::string & path, std::string & canonical)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+
+   auto it = this->paths_.find(path);
+   if (it == this->paths_.end() || it->second.user_ != user)
+      return false;
+
+   if (!this->fresh(it->second.at_, clock::now()))
+   {
+      this->paths_.erase(it);
+      return false;
+   }
+
+   canonical = it->second.canonical_;
+   return true;
+}
+
+void attribute_cache::store_path(const std::string & user, const std::string & path, const std::string & canonical)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   if (this->ttl_ == 0)
+      return;
+
+   auto now = clock::now();
+   this->make_room(now);
+
+   path_entry & entry = this->paths_[path];
+   entry.user_      = user;
+   entry.canonical_ = canonical;
+   entry.at_        = now;
+}
+
+void attribute_cache::invalidate(const std::string & path)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   this->attrs_.erase(path);
+   this->attrs_.erase(parent(path));
+}
+
+void attribute_cache::invalidate_tree(const std::string & path)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   this->attrs_.erase(parent(path));
+
+   auto under = [&path](const std::string & p)
+   {
+      return p.compare(0, path.length(), path) == 0 &&
+             (p.length() == path.length() || p[path.length()] == '/');
+   };
+
+   // A symlink removed takes with it whatever was reached through it.
+   for (auto it = this->attrs_.begin(); it != this->attrs_.end(); )
+      it = under(it->first) ? this->attrs_.erase(it) : std::next(it);
+
+   for (auto it = this->paths_.begin(); it != this->paths_.end(); )
+   {
+      if (under(it->first) || under(it->second.canonical_))
+         it = this->paths_.erase(it);
+      else
+         ++it;
+   }
+}
+
+void attribute_cache::clear()
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   this->attrs_.clear();
+   this->paths_.clear();
+}
+
+}
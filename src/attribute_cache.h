@@ -0,0 +1,92 @@
+#ifndef ATTRIBUTE_CACHE_H
+#define ATTRIBUTE_CACHE_H
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "sftp_file.h"
+
+namespace charon {
+
+   // Remote attributes and realpaths remembered for a few seconds, shared
+   // by every session to one server so that a write on any of them is
+   // seen by all. Paths known not to exist are kept too. Our own writes
+   // invalidate what they touch; the TTL bounds how long a change made by
+   // anyone else, or through another name for the same file, goes unseen.
+   class attribute_cache
+   {
+      public :
+
+         static const int    DEFAULT_TTL_SECS = 20;
+         static const size_t MAX_ENTRIES      = 1 << 16;
+
+         enum lookup_result
+         {
+            MISS,
+            PRESENT,
+            ABSENT
+         };
+
+      private :
+
+         using clock = std::chrono::steady_clock;
+
+         // One user's view of a path; another user's lookup misses.
+         struct attr_entry
+         {
+            std::string       user_;
+            bool              exists_;
+            sftp_file         attrs_;
+            clock::time_point at_;
+         };
+
+         struct path_entry
+         {
+            std::string       user_;
+            std::string       canonical_;
+            clock::time_point at_;
+         };
+
+         std::mutex  lock_;
+         int         ttl_;            // seconds; 0 turns caching off
+         std::unordered_map<std::string, attr_entry> attrs_;
+         std::unordered_map<std::string, path_entry> paths_;
+
+         static std::string parent(const std::string & path);
+         bool fresh(clock::time_point at, clock::time_point now) const;
+
+         // Caller holds lock_.
+         void make_room(clock::time_point now);
+
+      public :
+
+         explicit attribute_cache(int ttl_secs = DEFAULT_TTL_SECS);
+
+         attribute_cache(const attribute_cache & rhs) = delete;
+         attribute_cache & operator=(const attribute_cache & rhs) = delete;
+
+         void set_ttl(int secs);
+         int  get_ttl() const {return this->ttl_;}
+
+         lookup_result lookup(const std::string & user, const std::string & path, sftp_file & attrs);
+         void          store(const std::string & user, const std::string & path, const sftp_file & attrs);
+         void          store_absent(const std::string & user, const std::string & path);
+
+         bool lookup_path(const std::string & user, const std::string & path, std::string & canonical);
+         void store_path(const std::string & user, const std::string & path, const std::string & canonical);
+
+         // Forget path and its parent directory, whose times it changed.
+         void invalidate(const std::string & path);
+
+         // As invalidate(), for a path created or removed; whatever was
+         // looked up through it goes too.
+         void invalidate_tree(const std::string & path);
+
+         void clear();
+   };
+}
+
+#endif // ATTRIBUTE_CACHE_H
@@ -0,0 +1,93 @@
+#include <algorithm>
+
+#include "bandwidth_scheduler.h"
+
+namespace charon {
+
+bandwidth_scheduler::bandwidth_scheduler()
+   : rate_(0),
+     tokens_(0),
+     last_(clock_t::now()),
+     vtime_(0),
+     arrivals_(0)
+{
+}
+
+void bandwidth_scheduler::refill(clock_t::time_point now)
+{
+   double rate = static_cast<double>(this->rate_.load());
+   double elapsed = std::chrono::duration<double>(now - this->last_).count();
+
+   this->tokens_ = std::min(this->tokens_ + elapsed * rate, rate * BURST_SECONDS);
+   this->last_ = now;
+}
+
+void bandwidth_scheduler::set_rate(uint64_t rate)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+
+   this->refill(clock_t::now());
+   this->rate_.store(rate);
+   this->tokens_ = std::min(this->tokens_, rate * BURST_SECONDS);
+
+   this->cv_.notify_all();
+}
+
+void bandwidth_scheduler::charge(size_t bytes)
+{
+   if (this->rate_.load() == 0)
+      return;
+
+   std::lock_guard<std::mutex> guard(this->lock_);
+   this->refill(clock_t::now());
+   this->tokens_ -= bytes;
+}
+
+bandwidth_scheduler::flow::flow(bandwidth_scheduler * sched, size_t weight)
+   : sched_(sched),
+     weight_((weight > 0) ? static_cast<double>(weight) : 1.0),
+     vtime_(0)
+{
+}
+
+void bandwidth_scheduler::flow::acquire(size_t bytes)
+{
+   bandwidth_scheduler * s = this->sched_;
+   if (s == nullptr || s->rate_.load() == 0)
+      return;
+
+   std::unique_lock<std::mutex> lock(s->lock_);
+
+   // A flow returning from idle starts level with the others.
+   this->vtime_ = std::max(this->vtime_, s->vtime_) + bytes / this->weight_;
+   ticket mine(this->vtime_, s->arrivals_++);
+   s->waiting_.insert(mine);
+
+   for (;;)
+   {
+      uint64_t rate = s->rate_.load();
+      if (rate == 0)
+         break;
+
+      s->refill(clock_t::now());
+
+      // The head may overdraw the bucket; whoever follows pays it back.
+      bool head = (*s->waiting_.begin() == mine);
+      if (head && s->tokens_ >= 0)
+      {
+         s->tokens_ -= bytes;
+         break;
+      }
+
+      if (head)
+         s->cv_.wait_for(lock, std::chrono::duration<double>(-s->tokens_ / rate));
+      else
+         s->cv_.wait(lock);
+   }
+
+   s->vtime_ = std::max(s->vtime_, mine.first);
+   s->waiting_.erase(mine);
+   s->cv_.notify_all();
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef BANDWIDTH_SCHEDULER_H
+#define BANDWIDTH_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <utility>
+
+namespace charon {
+
+   // Token bucket shared by every transfer on a server's connections.
+   //
+   // With a global rate set, bulk flows queue for tokens in order of
+   // their weighted virtual finish time, so each active flow gets a share
+   // proportional to its weight and idle flows bank no credit.  Tokens are
+   // never reserved, so a lone flow still gets the whole rate.  Interactive
+   // traffic (listings, stats) bypasses the queue and is only debited.
+   // Without a rate nothing ever waits.
+   class bandwidth_scheduler
+   {
+      private :
+         using clock_t = std::chrono::steady_clock;
+         using ticket  = std::pair<double, uint64_t>;     // finish time, arrival
+
+         // Bucket depth, as time at the full rate.
+         static constexpr double BURST_SECONDS = 0.05;
+
+         std::atomic<uint64_t>   rate_;      // bytes/second, 0 = uncapped
+
+         std::mutex              lock_;
+         std::condition_variable cv_;
+         double                  tokens_;
+         clock_t::time_point     last_;
+         double                  vtime_;     // finish time of the last grant
+         uint64_t                arrivals_;
+         std::set<ticket>        waiting_;
+
+         void refill(clock_t::time_point now);
+
+      public :
+
+         // One transfer's registration; acquire() before each request.
+         class flow
+         {
+            private :
+               bandwidth_scheduler * sched_;
+               double                weight_;
+               double                vtime_;
+
+            public :
+
+               flow(bandwidth_scheduler * sched, size_t weight);
+
+               flow(const flow & rhs) = delete;
+               flow & operator=(const flow & rhs) = delete;
+
+               void acquire(size_t bytes);
+         };
+
+         bandwidth_scheduler();
+
+         bandwidth_scheduler(const bandwidth_scheduler & rhs) = delete;
+         bandwidth_scheduler & operator=(const bandwidth_scheduler & rhs) = delete;
+
+         void     set_rate(uint64_t rate);
+         uint64_t get_rate() const {return this->rate_.load();}
+
+         // Interactive bytes: never wait, but bulk flows make room for them.
+         void     charge(size_t bytes);
+   };
+}
+
+#endif // BANDWIDTH_SCHEDULER_H
@@ -0,0 +1,343 @@
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <limits.h>
+#include <unistd.h>
+
+#include "concurrent/thread_pool.h"
+#include "core/text/string_util.h"
+
+#include "batch_runner.h"
+
+using string_util = sk3l::core::text::string_util;
+
+namespace charon {
+
+batch_runner::batch_runner
+(
+   sftp_server & server,
+   const std::string & user,
+   sftp_connection & primary,
+   compression_router & router,
+   const exec_fn & exec
+)
+   : server_(server),
+     user_(user),
+     primary_(primary),
+     router_(router),
+     exec_(exec),
+     workers_(0),
+     failed_(0)
+{
+   char buf[PATH_MAX];
+   if (::getcwd(buf, sizeof(buf)) != nullptr)
+      this->local_cwd_ = buf;
+}
+
+std::string batch_runner::local_key(const std::string & path) const
+{
+   std::string key = (path.length() > 0 && path[0] == '/') ? path : this->local_cwd_ + "/" + path;
+   while (key.length() > 1 && key[key.length() - 1] == '/')
+      key.erase(key.length() - 1);
+   return "L:" + key;
+}
+
+std::string batch_runner::remote_key(const std::string & path) const
+{
+   std::string key = this->primary_.resolve_path(path);
+   while (key.length() > 1 && key[key.length() - 1] == '/')
+      key.erase(key.length() - 1);
+   return "R:" + key;
+}
+
+batch_runner::access batch_runner::classify(const cmd_data & cmd) const
+{
+   access acc = {false, {}, {}};
+
+   cmd_param_list params;
+   for (auto it = cmd.parameters_.begin(); it != cmd.parameters_.end(); ++it)
+      params.push_back(string_util::strip_ws(*it));
+
+   switch (cmd.type_)
+   {
+      case cmd_type::HELP:
+      case cmd_type::PWD:
+      case cmd_type::STATS:
+      break;
+
+      case cmd_type::LIST:
+         acc.reads_.push_back(this->remote_key(params.empty() ? "./" : params[0]));
+      break;
+
+      case cmd_type::STAT:
+         if (params.size() > 0)
+            acc.reads_.push_back(this->remote_key(params[0]));
+      break;
+
+      case cmd_type::PUT:
+      case cmd_type::GET:
+      {
+         while (params.size() > 0 && (params[0] == "-r" || params[0] == "-R"))
+         {
+            // Recursive mirrors run their own pool and aren't reentrant.
+            if (params[0] == "-R")
+               acc.barrier_ = true;
+            params.erase(params.begin());
+         }
+
+         if (acc.barrier_ || params.size() < 1 || params.size() > 2)
+            break;
+
+         if (cmd.type_ == cmd_type::PUT)
+         {
+            acc.reads_.push_back(this->local_key(params[0]));
+            acc.writes_.push_back(this->remote_key((params.size() == 2) ? params[1] : params[0]));
+         }
+         else
+         {
+            acc.reads_.push_back(this->remote_key(params[0]));
+            acc.writes_.push_back
+            (
+               this->local_key((params.size() == 2) ? params[1] : sftp_connection::base_name(params[0]))
+            );
+         }
+      }
+      break;
+
+      case cmd_type::SYNC:
+         if (params.size() < 1 || params.size() > 2)
+            break;
+
+         acc.reads_.push_back(this->local_key(params[0]));
+         acc.writes_.push_back
+         (
+            this->remote_key((params.size() == 2) ? params[1] : sftp_connection::base_name(params[0]))
+         );
+      break;
+
+      case cmd_type::MKDIR:
+      case cmd_type::RM:
+         if (params.size() > 0)
+            acc.writes_.push_back(this->remote_key(params[0]));
+      break;
+
+      case cmd_type::CP:
+         if (params.size() != 2)
+            break;
+
+         acc.reads_.push_back(this->remote_key(params[0]));
+         acc.writes_.push_back(this->remote_key(params[1]));
+      break;
+
+      // cd and set change what every later command means; mput/mget run
+      // on a pool of their own.
+      default:
+         acc.barrier_ = true;
+      break;
+   }
+
+   return acc;
+}
+
+bool batch_runner::overlaps(const std::string & lhs, const std::string & rhs)
+{
+   const std::string & shorter = (lhs.length() <= rhs.length()) ? lhs : rhs;
+   const std::string & longer  = (lhs.length() <= rhs.length()) ? rhs : lhs;
+
+   if (longer.compare(0, shorter.length(), shorter) != 0)
+      return false;
+
+   // Equal, or one lies inside the other as a directory.
+   return longer.length() == shorter.length() || longer[shorter.length()] == '/';
+}
+
+bool batch_runner::conflicts(const access & lhs, const access & rhs)
+{
+   for (auto w = lhs.writes_.begin(); w != lhs.writes_.end(); ++w)
+   {
+      for (auto it = rhs.writes_.begin(); it != rhs.writes_.end(); ++it)
+         if (overlaps(*w, *it))
+            return true;
+      for (auto it = rhs.reads_.begin(); it != rhs.reads_.end(); ++it)
+         if (overlaps(*w, *it))
+            return true;
+   }
+
+   for (auto w = rhs.writes_.begin(); w != rhs.writes_.end(); ++w)
+      for (auto it = lhs.reads_.begin(); it != lhs.reads_.end(); ++it)
+         if (overlaps(*w, *it))
+            return true;
+
+   return false;
+}
+
+bool batch_runner::execute
+(
+   sftp_connection & conn,
+   compression_router & router,
+   cmd_data & cmd,
+   std::ostream & out,
+   std::ostream & err
+)
+{
+   try
+   {
+      return this->exec_(conn, router, cmd, out, err);
+   }
+   catch (const std::exception & e)
+   {
+      err << "!! line " << cmd.line_ << ": " << e.what() << std::endl;
+   }
+   catch (...)
+   {
+      err << "!! line " << cmd.line_ << ": unknown error" << std::endl;
+   }
+
+   return false;
+}
+
+size_t batch_runner::run(std::vector<cmd_data> & script)
+{
+   using sk3l::concurrent::thread_pool;
+   using sk3l::concurrent::thread_pool_job_base;
+   using sk3l::concurrent::thread_pool_job_rv;
+
+   size_t max_workers = this->primary_.get_transfer_options().workers_;
+   if (max_workers < 1)
+      max_workers = 1;
+
+   this->failed_ = 0;
+
+   thread_pool pool(max_workers);
+
+   for (auto it = script.begin(); it != script.end(); ++it)
+   {
+      cmd_data & cmd = *it;
+      access acc = this->classify(cmd);
+
+      std::unique_lock<std::mutex> lock(this->lock_);
+
+      if (acc.barrier_)
+      {
+         this->cv_.wait(lock, [this] {return this->running_.empty();});
+         lock.unlock();
+
+         bool ok = this->execute(this->primary_, this->router_, cmd, std::cout, std::cerr);
+
+         lock.lock();
+         if (!ok)
+            ++this->failed_;
+         continue;
+      }
+
+      // Wait for a free worker and for every earlier command sharing a
+      // path with this one.
+      this->cv_.wait
+      (
+         lock,
+         [this, &acc, max_workers]
+         {
+            if (this->idle_.empty() && this->workers_ >= max_workers)
+               return false;
+            for (auto r = this->running_.begin(); r != this->running_.end(); ++r)
+               if (conflicts(*r, acc))
+                  return false;
+            return true;
+         }
+      );
+
+      worker_ptr w;
+      if (!this->idle_.empty())
+      {
+         w = this->idle_.back();
+         this->idle_.pop_back();
+      }
+      else
+      {
+         w = std::make_shared<worker>();
+         ++this->workers_;
+      }
+
+      auto slot = this->running_.insert(this->running_.end(), acc);
+      lock.unlock();
+
+      // The primary only moves at barriers, when nothing else is running.
+      std::string cwd = this->primary_.get_working_directory();
+      transfer_options opts = this->primary_.get_transfer_options();
+
+      pool.post
+      (
+         std::shared_ptr<thread_pool_job_base>
+         (
+            new thread_pool_job_rv<void>
+            (
+               [this, w, slot, cwd, opts, cmd]() mutable
+               {
+                  std::ostringstream out;
+                  std::ostringstream err;
+                  bool ok = false;
+
+                  try
+                  {
+                     if (!w->conn_)
+                     {
+                        w->conn_ = this->server_.checkout(this->user_);
+                        if (!w->conn_)
+                           throw std::logic_error("Encountered error in batch: couldn't open a worker connection");
+                        w->router_.reset(new compression_router(this->server_, this->user_));
+                     }
+
+                     if (w->conn_->get_working_directory() != cwd)
+                        w->conn_->change_directory(cwd);
+                     w->conn_->set_transfer_options(opts);
+
+                     ok = this->execute(*w->conn_, *w->router_, cmd, out, err);
+                  }
+                  catch (const std::exception & e)
+                  {
+                     err << "!! line " << cmd.line_ << ": " << e.what() << std::endl;
+                  }
+
+                  {
+                     std::lock_guard<std::mutex> guard(transfer_monitor::output_lock());
+                     std::cout << out.str() << std::flush;
+                     std::cerr << err.str() << std::flush;
+                  }
+
+                  std::lock_guard<std::mutex> guard(this->lock_);
+                  this->running_.erase(slot);
+                  if (w->conn_)
+                     this->idle_.push_back(w);
+                  else
+                     --this->workers_;
+                  if (!ok)
+                     ++this->failed_;
+                  this->cv_.notify_all();
+               }
+            )
+         )
+      );
+   }
+
+   {
+      std::unique_lock<std::mutex> lock(this->lock_);
+      this->cv_.wait(lock, [this] {return this->running_.empty();});
+   }
+
+   pool.shutdown();
+
+   std::lock_guard<std::mutex> guard(this->lock_);
+   for (auto it = this->idle_.begin(); it != this->idle_.end(); ++it)
+   {
+      (*it)->router_.reset();
+      this->server_.checkin((*it)->conn_);
+   }
+   this->idle_.clear();
+   this->workers_ = 0;
+   return this->failed_;
+}
+
+}
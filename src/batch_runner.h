@@ -0,0 +1,100 @@
+#ifndef BATCH_RUNNER_H
+#define BATCH_RUNNER_H
+
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "cmd_parser.h"
+#include "compression_router.h"
+#include "sftp_connection.h"
+#include "sftp_server.h"
+
+namespace charon {
+
+   // Runs a parsed script, issuing each command as soon as nothing still
+   // running before it touches the same path. Independent commands go to
+   // a sk3l thread_pool, each worker on a connection of its own; cd, set,
+   // and the multi-file commands are barriers run on the primary session
+   // once everything ahead of them has finished.
+   class batch_runner
+   {
+      public :
+
+         // Runs one command on conn, writing its output to out and its
+         // complaints to err; false when it was rejected without running.
+         using exec_fn =
+            std::function<bool(sftp_connection &, compression_router &, cmd_data &, std::ostream &, std::ostream &)>;
+
+      private :
+
+         struct access
+         {
+            bool                     barrier_;
+            std::vector<std::string> reads_;      // "L:" / "R:" prefixed paths
+            std::vector<std::string> writes_;
+         };
+
+         struct worker
+         {
+            sftp_conn_ptr                       conn_;
+            std::unique_ptr<compression_router> router_;
+         };
+         using worker_ptr = std::shared_ptr<worker>;
+
+         sftp_server &           server_;
+         std::string             user_;
+         sftp_connection &       primary_;
+         compression_router &    router_;
+         exec_fn                 exec_;
+         std::string             local_cwd_;
+
+         std::mutex              lock_;
+         std::condition_variable cv_;
+         std::list<access>       running_;
+         std::vector<worker_ptr> idle_;
+         size_t                  workers_;     // opened so far
+         size_t                  failed_;
+
+         std::string local_key(const std::string & path) const;
+         std::string remote_key(const std::string & path) const;
+
+         access classify(const cmd_data & cmd) const;
+
+         static bool overlaps(const std::string & lhs, const std::string & rhs);
+         static bool conflicts(const access & lhs, const access & rhs);
+
+         bool execute
+         (
+            sftp_connection & conn,
+            compression_router & router,
+            cmd_data & cmd,
+            std::ostream & out,
+            std::ostream & err
+         );
+
+      public :
+
+         batch_runner
+         (
+            sftp_server & server,
+            const std::string & user,
+            sftp_connection & primary,
+            compression_router & router,
+            const exec_fn & exec
+         );
+
+         batch_runner(const batch_runner & rhs) = delete;
+         batch_runner & operator=(const batch_runner & rhs) = delete;
+
+         // Returns the number of commands which failed.
+         size_t run(std::vector<cmd_data> & script);
+   };
+}
+
+#endif // BATCH_RUNNER_H
@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <unistd.h>
+
+#ifdef CHARON_HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#endif
+
+#include "cipher_selector.h"
+#include "local_state.h"
+
+namespace charon {
+
+namespace {
+
+struct ranked
+{
+   std::string name_;
+   double      rate_;      // bytes per second
+
+   bool operator<(const ranked & rhs) const {return this->rate_ > rhs.rate_;}
+};
+
+std::string join(const std::vector<ranked> & list, const std::string & tail)
+{
+   std::string out;
+   for (auto it = list.begin(); it != list.end(); ++it)
+      out += (out.empty() ? "" : ",") + it->name_;
+
+   return (out.empty() || tail.empty()) ? out : out + "," + tail;
+}
+
+#ifdef CHARON_HAVE_OPENSSL
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+   return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Encrypts total bytes in packet-sized records; AEAD modes get a fresh
+// IV and a tag per record, as the transport does.
+double cipher_rate(const EVP_CIPHER * cipher, bool aead, size_t total, size_t packet)
+{
+   if (cipher == nullptr)
+      return 0;
+
+   std::unique_ptr<unsigned char[]> in(new unsigned char[packet]());
+   std::unique_ptr<unsigned char[]> out(new unsigned char[packet + EVP_MAX_BLOCK_LENGTH]);
+   unsigned char key[EVP_MAX_KEY_LENGTH] = {1};
+   unsigned char iv[EVP_MAX_IV_LENGTH] = {2};
+   unsigned char tag[16];
+
+   EVP_CIPHER_CTX * ctx = EVP_CIPHER_CTX_new();
+   if (ctx == nullptr || EVP_EncryptInit_ex(ctx, cipher, nullptr, key, iv) != 1)
+   {
+      EVP_CIPHER_CTX_free(ctx);
+      return 0;
+   }
+
+   bool ok = true;
+   auto start = std::chrono::steady_clock::now();
+
+   for (size_t done = 0; ok && done < total; done += packet)
+   {
+      int len = 0;
+      if (aead)
+      {
+         ++iv[0];
+         ok = EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) == 1;
+      }
+
+      ok = ok && EVP_EncryptUpdate(ctx, out.get(), &len, in.get(), packet) == 1;
+
+      if (aead)
+      {
+         ok = ok && EVP_EncryptFinal_ex(ctx, out.get() + len, &len) == 1;
+         ok = ok && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, sizeof(tag), tag) == 1;
+      }
+   }
+
+   double secs = seconds_since(start);
+   EVP_CIPHER_CTX_free(ctx);
+
+   return (ok && secs > 0) ? total / secs : 0;
+}
+
+double mac_rate(const EVP_MD * md, size_t total, size_t packet)
+{
+   std::unique_ptr<unsigned char[]> in(new unsigned char[packet]());
+   unsigned char key[64] = {3};
+   unsigned char out[EVP_MAX_MD_SIZE];
+   unsigned int out_len = 0;
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (size_t done = 0; done < total; done += packet)
+   {
+      if (HMAC(md, key, EVP_MD_size(md), in.get(), packet, out, &out_len) == nullptr)
+         return 0;
+   }
+
+   double secs = seconds_since(start);
+   return (secs > 0) ? total / secs : 0;
+}
+#endif
+
+}
+
+cipher_selector::cipher_selector(const std::string & host, short port)
+{
+   // A shared $HOME may follow us to machines with other CPUs.
+   char local[256] = {0};
+   ::gethostname(local, sizeof(local) - 1);
+
+   std::stringstream key;
+   key << local << '\n' << host << ':' << port;
+   try
+   {
+      this->file_ = state_path("ciphers/" + state_key(key.str()));
+   }
+   catch (const std::exception &)
+   {
+      // No state directory (read-only or missing HOME); libssh's own order.
+      return;
+   }
+
+   if (!this->load())
+   {
+      this->benchmark();
+      this->save();
+   }
+}
+
+bool cipher_selector::load()
+{
+   std::ifstream in(this->file_);
+   if (!in)
+      return false;
+
+   std::getline(in, this->ciphers_);
+   std::getline(in, this->macs_);
+
+   return !in.fail() && !this->ciphers_.empty();
+}
+
+void cipher_selector::save() const
+{
+   if (this->ciphers_.empty())
+      return;
+
+   // Other invocations may be reading it, or benchmarking too; each
+   // writes a file of its own and renames it into place.
+   std::stringstream tmp;
+   tmp << this->file_ << "." << ::getpid() << "." << this;
+   {
+      std::ofstream out(tmp.str(), std::ios::trunc);
+      out << this->ciphers_ << '\n' << this->macs_ << '\n';
+      if (!out)
+      {
+         std::remove(tmp.str().c_str());
+         return;
+      }
+   }
+
+   if (std::rename(tmp.str().c_str(), this->file_.c_str()) != 0)
+      std::remove(tmp.str().c_str());
+}
+
+void cipher_selector::benchmark()
+{
+#ifdef CHARON_HAVE_OPENSSL
+   std::vector<ranked> macs;
+   macs.push_back({"hmac-sha2-256-etm@openssh.com,hmac-sha2-256", mac_rate(EVP_sha256(), BENCH_BYTES, PACKET_SIZE)});
+   macs.push_back({"hmac-sha2-512-etm@openssh.com,hmac-sha2-512", mac_rate(EVP_sha512(), BENCH_BYTES, PACKET_SIZE)});
+   std::sort(macs.begin(), macs.end());
+
+   // Non-AEAD ciphers pay for the fastest MAC on top of encryption.
+   double mac = macs.front().rate_;
+   auto with_mac = [mac](double rate) {return (rate > 0 && mac > 0) ? 1 / (1 / rate + 1 / mac) : 0;};
+
+   std::vector<ranked> ciphers;
+   ciphers.push_back({"aes128-gcm@openssh.com", cipher_rate(EVP_aes_128_gcm(), true, BENCH_BYTES, PACKET_SIZE)});
+   ciphers.push_back({"aes256-gcm@openssh.com", cipher_rate(EVP_aes_256_gcm(), true, BENCH_BYTES, PACKET_SIZE)});
+   ciphers.push_back({"aes128-ctr", with_mac(cipher_rate(EVP_aes_128_ctr(), false, BENCH_BYTES, PACKET_SIZE))});
+   ciphers.push_back({"aes256-ctr", with_mac(cipher_rate(EVP_aes_256_ctr(), false, BENCH_BYTES, PACKET_SIZE))});
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(OPENSSL_NO_CHACHA)
+   ciphers.push_back({"chacha20-poly1305@openssh.com", cipher_rate(EVP_chacha20_poly1305(), true, BENCH_BYTES, PACKET_SIZE)});
+#endif
+   std::sort(ciphers.begin(), ciphers.end());
+
+   // Keep whatever else libssh offers by default as a last resort.
+   this->ciphers_ = join(ciphers, "aes192-ctr");
+   this->macs_ = join(macs, "hmac-sha1-etm@openssh.com,hmac-sha1");     // never ranked above SHA-2
+#endif
+}
+
+bool cipher_selector::apply(ssh_session session) const
+{
+   if (this->ciphers_.empty())
+      return true;      // nothing measured; libssh's own order
+
+   return ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, this->ciphers_.c_str()) == SSH_OK &&
+          ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, this->ciphers_.c_str()) == SSH_OK &&
+          ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, this->macs_.c_str()) == SSH_OK &&
+          ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, this->macs_.c_str()) == SSH_OK;
+}
+
+}
@@ -23,30 +23,21 @@ cmd_parser::cmd_parser()
    cmd_map_.insert("cd",   cmd_type::CD);
    cmd_map_.insert("stat", cmd_type::STAT);
    cmd_map_.insert("put",  cmd_type::PUT);
+   cmd_map_.insert("get",  cmd_type::GET);
+   cmd_map_.insert("set",  cmd_type::SET);
+   cmd_map_.insert("mput", cmd_type::MPUT);
+   cmd_map_.insert("mget", cmd_type::MGET);
+   cmd_map_.insert("sync", cmd_type::SYNC);
+   cmd_map_.insert("cp",   cmd_type::CP);
+   cmd_map_.insert("stats", cmd_type::STATS);
+   cmd_map_.insert("mkdir", cmd_type::MKDIR);
+   cmd_map_.insert("rm",   cmd_type::RM);
 }
 
-cmd_data cmd_parser::get_next_cmd()
+cmd_data cmd_parser::parse_line(const std::string & line)
 {
-   std::cout << "#> ";
-
-   std::string line;
-   if (!std::getline(std::cin, line))
-   {
-      std::cerr << "!! internal error; please try again.";
-      return {cmd_type::ERROR, {}};
-   }
-
-   line = string_util::strip_ws(line);
-
    if (line.length() < 1)
-   {
-      std::cerr << "?? null command received; "
-                << "please type 'help' for a list of commands, "
-                << "or type 'quit' to exit."
-                << std::endl;
-
-      return {cmd_type::UNKNOWN, {}};
-   }
+      return {cmd_type::UNKNOWN, {}, 0};
 
    auto pos = line.find_first_of(" \t");
    size_t len = line.length();
@@ -66,15 +57,70 @@ cmd_data cmd_parser::get_next_cmd()
 
    auto cmd_it = this->cmd_map_.find(string_util::to_lower(cmd));
    if (cmd_it == this->cmd_map_.end())
+      return {cmd_type::UNKNOWN, {cmd}, 0};
+
+   return {cmd_it->get_val(), args, 0};
+}
+
+cmd_data cmd_parser::get_next_cmd()
+{
+   std::cout << "#> ";
+
+   std::string line;
+   if (!std::getline(std::cin, line))
+   {
+      std::cout << std::endl;
+      return {cmd_type::QUIT, {}, 0};
+   }
+
+   cmd_data cmd = this->parse_line(string_util::strip_ws(line));
+
+   if (cmd.type_ == cmd_type::UNKNOWN && cmd.parameters_.empty())
+   {
+      std::cerr << "?? null command received; "
+                << "please type 'help' for a list of commands, "
+                << "or type 'quit' to exit."
+                << std::endl;
+   }
+   else if (cmd.type_ == cmd_type::UNKNOWN)
    {
-      std::cerr << "?? unknown command '" << cmd << "' received; "
+      std::cerr << "?? unknown command '" << cmd.parameters_[0] << "' received; "
                 << "please type 'help' for a list of commands."
                 << std::endl;
+   }
+
+   return cmd;
+}
+
+bool cmd_parser::read_script(std::istream & in, std::vector<cmd_data> & script)
+{
+   bool ok = true;
+
+   std::string line;
+   for (size_t lineno = 1; std::getline(in, line); ++lineno)
+   {
+      line = string_util::strip_ws(line);
+      if (line.length() < 1 || line[0] == '#')
+         continue;
+
+      cmd_data cmd = this->parse_line(line);
+      cmd.line_ = lineno;
+
+      if (cmd.type_ == cmd_type::QUIT)
+         break;
+
+      if (cmd.type_ == cmd_type::UNKNOWN)
+      {
+         std::cerr << "?? line " << lineno << ": unknown command '"
+                   << cmd.parameters_[0] << "'" << std::endl;
+         ok = false;
+         continue;
+      }
 
-      return {cmd_type::UNKNOWN, {}};
+      script.push_back(cmd);
    }
 
-   return {cmd_it->get_val(), args};
+   return ok;
 }
 
 }
@@ -1,6 +1,7 @@
 #ifndef CMD_PARSER_H
 #define CMD_PARSER_H
 
+#include <istream>
 #include <memory>
 #include <string>
 #include <vector>
@@ -19,7 +20,16 @@ namespace charon {
       PWD      = 3,
       CD       = 4,
       STAT     = 5,
-      PUT      = 6
+      PUT      = 6,
+      GET      = 7,
+      SET      = 8,
+      MPUT     = 9,
+      MGET     = 10,
+      SYNC     = 11,
+      CP       = 12,
+      STATS    = 13,
+      MKDIR    = 14,
+      RM       = 15
    };
 
    using cmd_param_list = std::vector<std::string>;
@@ -28,6 +38,7 @@ namespace charon {
    {
       cmd_type       type_;
       cmd_param_list parameters_;
+      size_t         line_;         // script line, in batch mode
    };
 
    class cmd_parser 
@@ -40,7 +51,15 @@ namespace charon {
       public :
 
          cmd_parser();
-         cmd_data get_next_cmd();         
+         cmd_data get_next_cmd();
+
+         // UNKNOWN for a blank line, or with the command name as its only
+         // parameter when the command isn't recognised.
+         cmd_data parse_line(const std::string & line);
+
+         // Parse a whole script up front, skipping blank and '#' lines and
+         // stopping at quit; false if any line named an unknown command.
+         bool read_script(std::istream & in, std::vector<cmd_data> & script);
    };
 }
 
@@ -0,0 +1,122 @@
+#include <memory>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "compression_router.h"
+#include "local_io.h"
+#include "sftp_connection.h"
+
+namespace charon {
+
+compression_router::compression_router(sftp_server & server, const std::string & user)
+   : server_(server),
+     user_(user)
+{
+}
+
+compression_router::~compression_router()
+{
+   this->server_.checkin(this->compressed_);
+}
+
+double compression_router::ratio(const char * buf, size_t len)
+{
+   if (len == 0)
+      return 1.0;
+
+   // Level 1: about what the transport would achieve per packet, and cheap.
+   uLongf out_len = ::compressBound(len);
+   std::unique_ptr<Bytef[]> out(new Bytef[out_len]);
+
+   if (::compress2(out.get(), &out_len, reinterpret_cast<const Bytef *>(buf), len, 1) != Z_OK)
+      return 1.0;
+
+   return static_cast<double>(len) / out_len;
+}
+
+bool compression_router::compress_upload(const transfer_options & opts, const std::string & lpath)
+{
+   if (opts.compress_ != COMPRESS_AUTO)
+      return opts.compress_ == COMPRESS_ON;
+
+   local_io::io_ptr local = local_io::open(lpath, local_io::READ, IO_PREAD);
+   if (!local)
+      return false;      // put() reports the open failure
+
+   std::unique_ptr<char[]> sample(new char[SAMPLE_SIZE]);
+   ssize_t len = local->read(sample.get(), SAMPLE_SIZE, 0);
+   local->close();
+
+   return len > 0 && ratio(sample.get(), len) >= MIN_RATIO;
+}
+
+bool compression_router::compress_download
+(
+   const transfer_options & opts,
+   sftp_connection & conn,
+   const std::string & rpath
+)
+{
+   if (opts.compress_ != COMPRESS_AUTO)
+      return opts.compress_ == COMPRESS_ON;
+
+   std::unique_ptr<char[]> sample(new char[SAMPLE_SIZE]);
+   size_t len = conn.peek(rpath, sample.get(), SAMPLE_SIZE);
+
+   return ratio(sample.get(), len) >= MIN_RATIO;
+}
+
+sftp_connection & compression_router::compressed(sftp_connection & primary)
+{
+   if (!this->compressed_)
+      this->compressed_ = this->server_.checkout(this->user_, true);
+
+   // Relative paths must resolve the same way on either session.
+   if (this->compressed_->get_working_directory() != primary.get_working_directory())
+      this->compressed_->change_directory(primary.get_working_directory());
+
+   this->compressed_->set_transfer_options(primary.get_transfer_options());
+   return *this->compressed_;
+}
+
+sftp_connection & compression_router::for_put(sftp_connection & primary, const std::string & lpath)
+{
+   if (!compress_upload(primary.get_transfer_options(), lpath))
+      return primary;
+
+   return this->compressed(primary);
+}
+
+sftp_connection & compression_router::for_get(sftp_connection & primary, const std::string & rpath)
+{
+   if (!compress_download(primary.get_transfer_options(), primary, rpath))
+      return primary;
+
+   return this->compressed(primary);
+}
+
+compress_mode compression_router::parse_mode(const std::string & name)
+{
+   if (name == "off" || name == "no" || name == "0")
+      return COMPRESS_OFF;
+   if (name == "on" || name == "yes" || name == "1")
+      return COMPRESS_ON;
+   if (name == "auto")
+      return COMPRESS_AUTO;
+
+   throw std::invalid_argument("Unknown compression mode '" + name + "' (off, on, auto)");
+}
+
+const char * compression_router::mode_name(compress_mode mode)
+{
+   switch (mode)
+   {
+      case COMPRESS_ON:   return "on";
+      case COMPRESS_AUTO: return "auto";
+      case COMPRESS_OFF:
+      default:            return "off";
+   }
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef COMPRESSION_ROUTER_H
+#define COMPRESSION_ROUTER_H
+
+#include <cstddef>
+#include <string>
+
+#include "sftp_server.h"
+#include "transfer_options.h"
+
+namespace charon {
+
+   class sftp_connection;
+
+   // Chooses between the primary (uncompressed) session and a second,
+   // zlib-compressed one checked out of sftp_server on first use.
+   class compression_router
+   {
+      private :
+
+         sftp_server &  server_;
+         std::string    user_;
+         sftp_conn_ptr  compressed_;
+
+         sftp_connection & compressed(sftp_connection & primary);
+
+         static double ratio(const char * buf, size_t len);
+
+      public :
+
+         // Bytes sampled from the head of a file, and the original /
+         // deflated ratio it must reach to be sent compressed.
+         static const size_t SAMPLE_SIZE = 256 * (1 << 10);
+         static constexpr double MIN_RATIO = 1.5;
+
+         static bool compress_upload(const transfer_options & opts, const std::string & lpath);
+         static bool compress_download
+         (
+            const transfer_options & opts,
+            sftp_connection & conn,
+            const std::string & rpath
+         );
+
+         static compress_mode parse_mode(const std::string & name);
+         static const char *  mode_name(compress_mode mode);
+
+         compression_router(sftp_server & server, const std::string & user);
+         ~compression_router();
+
+         compression_router(const compression_router & rhs) = delete;
+         compression_router & operator=(const compression_router & rhs) = delete;
+
+         sftp_connection & for_put(sftp_connection & primary, const std::string & lpath);
+         sftp_connection & for_get(sftp_connection & primary, const std::string & rpath);
+   };
+}
+
+#endif // COMPRESSION_ROUTER_H
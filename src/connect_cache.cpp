@@ -0,0 +1,80 @@
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "connect_cache.h"
+#include "local_state.h"
+
+namespace charon {
+
+connect_cache::connect_cache(const std::string & user, const std::string & host, short port)
+   : changed_(false)
+{
+   std::stringstream key;
+   key << user << "@" << host << ":" << port;
+   try
+   {
+      this->file_ = state_path("connect/" + state_key(key.str()));
+   }
+   catch (const std::exception &)
+   {
+      // No state directory; connect without the memo.
+      this->file_.clear();
+   }
+
+   if (!this->load())
+      this->auth_method_.clear();
+}
+
+bool connect_cache::load()
+{
+   if (this->file_.empty())
+      return false;
+
+   std::ifstream in(this->file_);
+   if (!in)
+      return false;
+
+   std::getline(in, this->auth_method_);
+
+   return !in.fail();
+}
+
+void connect_cache::set_auth_method(const std::string & method)
+{
+   if (method != this->auth_method_)
+   {
+      this->auth_method_ = method;
+      this->changed_ = true;
+   }
+}
+
+void connect_cache::save()
+{
+   if (!this->changed_ || this->file_.empty())
+      return;
+
+   // Striped transfers connect several sessions at once; each writes a
+   // file of its own and renames it into place.
+   std::stringstream tmp;
+   tmp << this->file_ << "." << ::getpid() << "." << this;
+   {
+      std::ofstream out(tmp.str(), std::ios::trunc);
+      out << this->auth_method_ << '\n';
+      if (!out)
+      {
+         std::remove(tmp.str().c_str());
+         return;
+      }
+   }
+
+   if (std::rename(tmp.str().c_str(), this->file_.c_str()) != 0)
+      std::remove(tmp.str().c_str());
+   else
+      this->changed_ = false;
+}
+
+}
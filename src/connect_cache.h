@@ -0,0 +1,38 @@
+#ifndef CONNECT_CACHE_H
+#define CONNECT_CACHE_H
+
+#include <string>
+
+namespace charon {
+
+   // What the last connect to user@host:port settled on: the auth method
+   // the server took. Kept under $HOME/.charon/connect so later connects
+   // skip the none/list round trips. Host keys are not remembered here;
+   // known_hosts (through its index) stays the only authority on those.
+   class connect_cache
+   {
+      private :
+
+         std::string file_;
+         std::string auth_method_;   // "none", "publickey", or empty
+         bool        changed_;
+
+         bool load();
+
+      public :
+
+         connect_cache(const std::string & user, const std::string & host, short port);
+
+         connect_cache(const connect_cache & rhs) = delete;
+         connect_cache & operator=(const connect_cache & rhs) = delete;
+
+         const std::string & auth_method() const {return this->auth_method_;}
+
+         void set_auth_method(const std::string & method);
+
+         // Writes the entry back if anything changed since it was loaded.
+         void save();
+   };
+}
+
+#endif // CONNECT_CACHE_H
@@ -0,0 +1,424 @@
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "core/text/string_util.h"
+
+#include "control_master.h"
+#include "local_state.h"
+
+using string_util = sk3l::core::text::string_util;
+
+namespace charon {
+
+namespace {
+
+bool write_all(int fd, const std::string & data)
+{
+   size_t sent = 0;
+   while (sent < data.length())
+   {
+      ssize_t rc = ::send(fd, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+      if (rc < 0 && errno == EINTR)
+         continue;
+      if (rc <= 0)
+         return false;
+      sent += rc;
+   }
+   return true;
+}
+
+// Next line from fd, keeping whatever followed it in pending.
+bool read_line(int fd, std::string & pending, std::string & line)
+{
+   for (;;)
+   {
+      auto nl = pending.find('\n');
+      if (nl != std::string::npos)
+      {
+         line = pending.substr(0, nl);
+         pending.erase(0, nl + 1);
+         return true;
+      }
+
+      char buf[4096];
+      ssize_t rc = ::recv(fd, buf, sizeof(buf), 0);
+      if (rc < 0 && errno == EINTR)
+         continue;
+      if (rc <= 0)
+         return false;
+      pending.append(buf, rc);
+   }
+}
+
+// text as reply lines tagged with the stream they belong on.
+std::string frame(char stream, const std::string & text)
+{
+   std::string out;
+   size_t pos = 0;
+   while (pos < text.length())
+   {
+      auto nl = text.find('\n', pos);
+      if (nl == std::string::npos)
+         nl = text.length();
+
+      out += stream;
+      out += ' ';
+      out.append(text, pos, nl - pos);
+      out += '\n';
+      pos = nl + 1;
+   }
+   return out;
+}
+
+bool make_address(const std::string & path, struct sockaddr_un & addr)
+{
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (path.length() >= sizeof(addr.sun_path))
+      return false;
+
+   strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+   return true;
+}
+
+}
+
+control_master::control_master(sftp_server & server, const std::string & user, const exec_fn & exec)
+   : server_(server),
+     user_(user),
+     exec_(exec),
+     clients_(0),
+     last_client_(std::chrono::steady_clock::now()),
+     cwd_users_(0)
+{
+}
+
+std::string control_master::socket_path(const std::string & user, const std::string & host, int port)
+{
+   std::stringstream key;
+   key << user << "@" << host << ":" << port;
+   return state_path("control/" + state_key(key.str()));
+}
+
+int control_master::connect_client(const std::string & path)
+{
+   struct sockaddr_un addr;
+   if (!make_address(path, addr))
+      return -1;
+
+   int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0)
+      return -1;
+
+   if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+   {
+      ::close(fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+int control_master::spawn(const std::string & path, const std::function<int()> & body)
+{
+   std::cout.flush();
+   std::cerr.flush();
+
+   pid_t pid = ::fork();
+   if (pid < 0)
+      return -1;
+
+   if (pid == 0)
+   {
+      int rc = 16;
+      try
+      {
+         rc = body();
+      }
+      catch (const std::exception & err)
+      {
+         std::cerr << err.what() << std::endl;
+      }
+      catch (...)
+      {
+         std::cerr << "Unable to start charon control daemon." << std::endl;
+      }
+      ::_exit(rc);
+   }
+
+   // The daemon may be waiting on a host key or password prompt, so
+   // there's no deadline, only its exit.
+   for (;;)
+   {
+      int fd = connect_client(path);
+      if (fd >= 0)
+         return fd;
+
+      int status;
+      if (::waitpid(pid, &status, WNOHANG) == pid)
+         return -1;
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+   }
+}
+
+size_t control_master::run_client(int fd, std::istream & in, bool prompt)
+{
+   size_t failed = 0;
+
+   char cwd[PATH_MAX];
+   if (::getcwd(cwd, sizeof(cwd)) == nullptr || !write_all(fd, std::string("cwd ") + cwd + "\n"))
+   {
+      std::cerr << "Lost connection to charon control daemon." << std::endl;
+      ::close(fd);
+      return 1;
+   }
+
+   std::string pending;
+   std::string line;
+   for (;;)
+   {
+      if (prompt)
+         std::cout << "#> " << std::flush;
+
+      if (!std::getline(in, line))
+         break;
+
+      line = string_util::strip_ws(line);
+      if (line.length() < 1 || line[0] == '#')
+         continue;
+
+      std::string cmd = string_util::to_lower(line.substr(0, line.find_first_of(" \t")));
+      if (cmd == "quit" || cmd == "q")
+         break;
+
+      if (!write_all(fd, line + "\n"))
+      {
+         std::cerr << "Lost connection to charon control daemon." << std::endl;
+         ++failed;
+         break;
+      }
+
+      std::string reply;
+      bool answered = false;
+      while (read_line(fd, pending, reply))
+      {
+         if (reply.compare(0, 2, "= ") == 0)
+         {
+            if (reply != "= 0")
+               ++failed;
+            answered = true;
+            break;
+         }
+
+         if (reply.compare(0, 2, "2 ") == 0)
+            std::cerr << reply.substr(2) << std::endl;
+         else
+            std::cout << reply.substr(std::min<size_t>(2, reply.length())) << std::endl;
+      }
+
+      if (!answered)
+      {
+         std::cerr << "Lost connection to charon control daemon." << std::endl;
+         ++failed;
+         break;
+      }
+   }
+
+   ::close(fd);
+   return failed;
+}
+
+void control_master::enter_cwd(const std::string & dir)
+{
+   std::unique_lock<std::mutex> lock(this->lock_);
+   this->cv_.wait(lock, [this, &dir] {return this->cwd_users_ == 0 || this->cwd_ == dir;});
+
+   if (this->cwd_ != dir)
+   {
+      if (::chdir(dir.c_str()) != 0)
+         throw std::logic_error("Encountered error in control master: couldn't change to local directory '" + dir + "'");
+      this->cwd_ = dir;
+   }
+
+   ++this->cwd_users_;
+}
+
+void control_master::leave_cwd()
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   --this->cwd_users_;
+   this->cv_.notify_all();
+}
+
+void control_master::handle(int fd)
+{
+   sftp_conn_ptr conn;
+
+   try
+   {
+      std::string pending;
+      std::string line;
+
+      // First comes the client's working directory, for its local paths.
+      if (!read_line(fd, pending, line) || line.compare(0, 4, "cwd ") != 0)
+         return;
+      std::string cwd = line.substr(4);
+
+      conn = this->server_.checkout(this->user_);
+      compression_router router(this->server_, this->user_);
+      cmd_parser parser;
+
+      while (read_line(fd, pending, line))
+      {
+         cmd_data cmd = parser.parse_line(string_util::strip_ws(line));
+         if (cmd.type_ == cmd_type::QUIT)
+            break;
+
+         std::ostringstream out;
+         std::ostringstream err;
+         bool ok = false;
+
+         if (cmd.type_ == cmd_type::UNKNOWN)
+         {
+            err << "?? unknown command '"
+                << (cmd.parameters_.empty() ? std::string() : cmd.parameters_[0]) << "'" << std::endl;
+         }
+         else
+         {
+            this->enter_cwd(cwd);
+            try
+            {
+               ok = this->exec_(*conn, router, cmd, out, err);
+            }
+            catch (const std::exception & e)
+            {
+               err << e.what() << std::endl;
+            }
+            catch (...)
+            {
+               err << "Unspecified error running command." << std::endl;
+            }
+            this->leave_cwd();
+         }
+
+         if (!write_all(fd, frame('1', out.str()) + frame('2', err.str()) + (ok ? "= 0\n" : "= 1\n")))
+            break;
+      }
+   }
+   catch (const std::exception & e)
+   {
+      write_all(fd, frame('2', e.what()) + "= 1\n");
+   }
+   catch (...)
+   {
+      write_all(fd, frame('2', "Unable to open a session for this client.") + "= 1\n");
+   }
+
+   this->server_.checkin(conn);
+}
+
+void control_master::serve(const std::string & path)
+{
+   struct sockaddr_un addr;
+   if (!make_address(path, addr))
+      throw std::logic_error("Encountered error in control master: socket path '" + path + "' is too long");
+
+   int lfd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+   if (lfd < 0)
+      throw std::logic_error("Encountered error in control master: couldn't create socket");
+
+   // Replaces the socket of a daemon which has since gone away.
+   ::unlink(path.c_str());
+   if (::bind(lfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+       ::chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+       ::listen(lfd, 16) != 0)
+   {
+      ::close(lfd);
+      throw std::logic_error("Encountered error in control master: couldn't listen on '" + path + "'");
+   }
+
+   // Let go of the terminal of the invocation which started us.
+   ::setsid();
+   ::signal(SIGPIPE, SIG_IGN);
+   int null_fd = ::open("/dev/null", O_RDWR);
+   if (null_fd >= 0)
+   {
+      ::dup2(null_fd, STDIN_FILENO);
+      ::dup2(null_fd, STDOUT_FILENO);
+      ::dup2(null_fd, STDERR_FILENO);
+      if (null_fd > STDERR_FILENO)
+         ::close(null_fd);
+   }
+
+   for (;;)
+   {
+      struct pollfd pfd = {lfd, POLLIN, 0};
+      if (::poll(&pfd, 1, 1000) > 0 && (pfd.revents & POLLIN))
+      {
+         int fd = ::accept(lfd, nullptr, nullptr);
+         if (fd >= 0)
+         {
+            // The socket is private already; refuse anyone else regardless.
+            struct ucred cred;
+            socklen_t len = sizeof(cred);
+            if (::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != ::getuid())
+            {
+               ::close(fd);
+               continue;
+            }
+
+            {
+               std::lock_guard<std::mutex> guard(this->lock_);
+               ++this->clients_;
+            }
+
+            std::thread
+            (
+               [this, fd]()
+               {
+                  this->handle(fd);
+                  ::close(fd);
+
+                  std::lock_guard<std::mutex> guard(this->lock_);
+                  --this->clients_;
+                  this->last_client_ = std::chrono::steady_clock::now();
+                  this->cv_.notify_all();
+               }
+            ).detach();
+         }
+      }
+
+      std::lock_guard<std::mutex> guard(this->lock_);
+      if (this->clients_ == 0 &&
+          std::chrono::steady_clock::now() - this->last_client_ > std::chrono::seconds(IDLE_TIMEOUT_SECS))
+         break;
+   }
+
+   ::close(lfd);
+
+   // Leave the path alone if a newer daemon has taken it over.
+   int fd = connect_client(path);
+   if (fd >= 0)
+      ::close(fd);
+   else
+      ::unlink(path.c_str());
+}
+
+}
@@ -0,0 +1,82 @@
+#ifndef CONTROL_MASTER_H
+#define CONTROL_MASTER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#include "cmd_parser.h"
+#include "compression_router.h"
+#include "sftp_connection.h"
+#include "sftp_server.h"
+
+namespace charon {
+
+   // ControlMaster-style daemon holding authenticated sessions for one
+   // endpoint behind a Unix socket under ~/.charon/control, so later
+   // invocations skip the handshake. Each client gets a pooled session
+   // and sends one command per line. Each reply is made of lines that
+   // start with "1 " (stdout) or "2 " (stderr) and ends with "= <status>".
+   class control_master
+   {
+      public :
+
+         using exec_fn =
+            std::function<bool(sftp_connection &, compression_router &, cmd_data &, std::ostream &, std::ostream &)>;
+
+      private :
+
+         sftp_server &           server_;
+         std::string             user_;
+         exec_fn                 exec_;
+
+         std::mutex              lock_;
+         std::condition_variable cv_;
+         size_t                  clients_;
+         std::chrono::steady_clock::time_point last_client_;
+
+         // Commands resolve local paths against the process's working
+         // directory, shared by every client; those from clients in other
+         // directories wait their turn.
+         std::string             cwd_;
+         size_t                  cwd_users_;
+
+         void enter_cwd(const std::string & dir);
+         void leave_cwd();
+
+         void handle(int fd);
+
+      public :
+
+         // Exit once no client has been connected for this long.
+         static const int IDLE_TIMEOUT_SECS = 600;
+
+         static std::string socket_path(const std::string & user, const std::string & host, int port);
+
+         // A socket connected to the daemon at path, or -1 if none is up.
+         static int connect_client(const std::string & path);
+
+         // Fork a daemon running body (which should end in serve()) and
+         // wait for it to accept; -1 if it exited first.
+         static int spawn(const std::string & path, const std::function<int()> & body);
+
+         // Send the commands read from in, printing the replies; returns
+         // the number which failed.
+         static size_t run_client(int fd, std::istream & in, bool prompt);
+
+         control_master(sftp_server & server, const std::string & user, const exec_fn & exec);
+
+         control_master(const control_master & rhs) = delete;
+         control_master & operator=(const control_master & rhs) = delete;
+
+         // Listen on path, detach from the terminal and serve clients
+         // until idle.
+         void serve(const std::string & path);
+   };
+}
+
+#endif // CONTROL_MASTER_H
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core/datetime/long_clock.h"
+
+#include "delta_sync.h"
+#include "local_state.h"
+
+using sk3l::core::datetime::long_clock;
+
+namespace charon {
+
+delta_sync::delta_sync(sftp_connection & conn, std::ostream & out)
+   : conn_(conn),
+     out_(out)
+{
+}
+
+delta_sync::signature delta_sync::compute(const std::string & lpath)
+{
+   int fd = ::open(lpath.c_str(), O_RDONLY);
+   if (fd < 0)
+      throw std::logic_error("Encountered error in sync(): couldn't open file at local path '" + lpath + "'");
+
+   std::unique_ptr<unsigned char[]> buffer(new unsigned char[BLOCK_SIZE]);
+   signature sig;
+
+   for (;;)
+   {
+      size_t len = 0;
+      while (len < BLOCK_SIZE)
+      {
+         ssize_t rc = ::read(fd, buffer.get() + len, BLOCK_SIZE - len);
+         if (rc < 0 && errno == EINTR)
+            continue;
+         if (rc < 0)
+         {
+            ::close(fd);
+            throw std::logic_error("Encountered error in sync(): I/O error reading local file '" + lpath + "'");
+         }
+         if (rc == 0)
+            break;
+         len += rc;
+      }
+
+      if (len == 0)
+         break;
+
+      uint64_t h = 14695981039346656037ULL;
+      for (size_t i = 0; i < len; ++i)
+      {
+         h ^= buffer[i];
+         h *= 1099511628211ULL;
+      }
+
+      sig.push_back(h);
+
+      if (len < BLOCK_SIZE)
+         break;
+   }
+
+   ::close(fd);
+   return sig;
+}
+
+bool delta_sync::load
+(
+   const std::string & file,
+   const std::string & rpath,
+   uint64_t size,
+   std::time_t mtime,
+   signature & sig
+) const
+{
+   std::ifstream in(file);
+   if (!in)
+      return false;
+
+   std::string path, kind;
+   uint64_t rsize = 0, block = 0;
+   long long rmtime = 0;
+
+   std::getline(in, path);
+   in >> rsize >> rmtime >> block >> kind;
+
+   // Stale unless the remote copy is still exactly what we left there.
+   if (!in || path != rpath || rsize != size || rmtime != mtime ||
+       block != BLOCK_SIZE || kind != "fnv1a")
+      return false;
+
+   uint64_t sum;
+   while (in >> sum)
+      sig.push_back(sum);
+
+   return true;
+}
+
+void delta_sync::save
+(
+   const std::string & file,
+   const std::string & rpath,
+   uint64_t size,
+   std::time_t mtime,
+   const signature & sig
+) const
+{
+   std::string tmp = file + ".tmp";
+   {
+      std::ofstream out(tmp, std::ios::trunc);
+      out << rpath << '\n'
+          << size << ' ' << static_cast<long long>(mtime) << ' ' << BLOCK_SIZE << " fnv1a\n";
+
+      for (auto it = sig.begin(); it != sig.end(); ++it)
+         out << *it << '\n';
+
+      if (!out)
+         return;
+   }
+
+   std::rename(tmp.c_str(), file.c_str());
+}
+
+void delta_sync::sync(const std::string & lpath, const std::string & rpath)
+{
+   std::string dest =
+      this->conn_.resolve_path((rpath.length() > 0) ? rpath : sftp_connection::base_name(lpath));
+
+   struct stat st;
+   if (::stat(lpath.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+      throw std::logic_error("Encountered error in sync(): couldn't stat file at local path '" + lpath + "'");
+
+   uint64_t lsize = static_cast<uint64_t>(st.st_size);
+   std::time_t lmtime = st.st_mtime;
+
+   bool exists = false;
+   uint64_t rsize = 0;
+   std::time_t rmtime = 0;
+   try
+   {
+      sftp_file remote = this->conn_.stat(dest);
+      exists = remote.is_file();
+      rsize = remote.get_size();
+      rmtime = long_clock::to_time_t(remote.get_mod_time().get_time_point());
+   }
+   catch (const std::logic_error &)
+   {
+      // No remote copy yet
+   }
+
+   if (exists && rsize == lsize && rmtime == lmtime)
+   {
+      this->out_ << "*--Skipping '" << lpath << "': unchanged." << std::endl;
+      return;
+   }
+
+   std::string sig_file = state_path("signatures/" + state_key(absolute_path(lpath) + '\n' + dest));
+
+   signature local_sig = compute(lpath);
+   signature remote_sig;
+
+   if (exists && this->load(sig_file, dest, rsize, rmtime, remote_sig))
+   {
+      sftp_connection::range_list ranges;
+      size_t changed = 0;
+
+      for (size_t i = 0; i < local_sig.size(); ++i)
+      {
+         if (i < remote_sig.size() && local_sig[i] == remote_sig[i])
+            continue;
+
+         ++changed;
+
+         uint64_t offset = i * BLOCK_SIZE;
+         uint64_t length = std::min(static_cast<uint64_t>(BLOCK_SIZE), lsize - offset);
+
+         // Coalesce runs of changed blocks into one range.
+         if (!ranges.empty() && ranges.back().first + ranges.back().second == offset)
+            ranges.back().second += length;
+         else
+            ranges.push_back(std::make_pair(offset, length));
+      }
+
+      this->conn_.put_ranges(lpath, dest, ranges);
+      if (rsize != lsize)
+         this->conn_.set_size(dest, lsize);
+
+      this->out_ << "*--Synced '" << lpath << "': sent " << changed
+                 << " of " << local_sig.size() << " block(s)." << std::endl;
+   }
+   else
+   {
+      this->conn_.put(lpath, dest);
+      this->out_ << "*--Synced '" << lpath << "': full upload." << std::endl;
+   }
+
+   // Stamp the remote copy with our mtime so the next sync can skip it.
+   this->conn_.set_mod_time(dest, lmtime);
+
+   sftp_file remote = this->conn_.stat(dest);
+   this->save
+   (
+      sig_file,
+      dest,
+      remote.get_size(),
+      long_clock::to_time_t(remote.get_mod_time().get_time_point()),
+      local_sig
+   );
+}
+
+}
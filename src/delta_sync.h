@@ -0,0 +1,66 @@
+#ifndef DELTA_SYNC_H
+#define DELTA_SYNC_H
+
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "sftp_connection.h"
+
+namespace charon {
+
+   // Pushes a local file only if it differs from the remote copy, and then
+   // only the blocks that changed since the last sync. Blocks are compared
+   // at fixed offsets: SFTP can't move data within a remote file, so a
+   // block that merely shifted (after an insertion or deletion) is sent
+   // again along with everything after it.
+   //
+   // SFTP gives no way to checksum remote data without reading it back, so
+   // the block signatures of what was last pushed are kept locally (under
+   // ~/.charon/signatures) along with the remote size and mtime they
+   // describe; a remote copy touched by anyone else gets a full upload.
+   class delta_sync
+   {
+      private :
+         static const uint64_t BLOCK_SIZE = 1 << 20;
+
+         // FNV-1a 64 of each BLOCK_SIZE block, in file order.
+         using signature = std::vector<uint64_t>;
+
+         sftp_connection & conn_;
+         std::ostream &    out_;
+
+         static signature compute(const std::string & lpath);
+
+         bool load
+         (
+            const std::string & file,
+            const std::string & rpath,
+            uint64_t size,
+            std::time_t mtime,
+            signature & sig
+         ) const;
+
+         void save
+         (
+            const std::string & file,
+            const std::string & rpath,
+            uint64_t size,
+            std::time_t mtime,
+            const signature & sig
+         ) const;
+
+      public :
+
+         delta_sync(sftp_connection & conn, std::ostream & out);
+
+         delta_sync(const delta_sync & rhs) = delete;
+         delta_sync & operator=(const delta_sync & rhs) = delete;
+
+         void sync(const std::string & lpath, const std::string & rpath = "");
+   };
+}
+
+#endif // DELTA_SYNC_H
@@ -0,0 +1,123 @@
+#include <sstream>
+#include <stdexcept>
+
+#include "directory_stream.h"
+
+namespace charon {
+
+directory_stream::directory_stream
+(
+   ::sftp_session session,
+   std::recursive_mutex & session_lock,
+   const std::string & path
+)
+   : session_(session),
+     session_lock_(session_lock),
+     path_(path),
+     dir_(nullptr),
+     eof_(false),
+     stop_(false)
+{
+   {
+      std::lock_guard<std::recursive_mutex> guard(this->session_lock_);
+      this->dir_ = sftp_opendir(this->session_, path.c_str());
+   }
+
+   if (this->dir_ == nullptr)
+      throw std::logic_error("Couldn't open directory at '" + path + "'");
+
+   this->worker_ = std::thread(&directory_stream::work_routine, this);
+}
+
+directory_stream::~directory_stream()
+{
+   this->close();
+}
+
+void directory_stream::work_routine()
+{
+   std::unique_lock<std::mutex> lock(this->lock_);
+
+   for (;;)
+   {
+      this->cv_.wait(lock, [this] {return this->stop_ || this->ready_.size() < DEPTH;});
+      if (this->stop_)
+         return;
+
+      lock.unlock();
+
+      // Mostly served from the reply libssh already holds; one call in
+      // every batch goes to the server.
+      sftp_attributes attrs;
+      bool eof = false;
+      int err = SSH_FX_OK;
+      {
+         std::lock_guard<std::recursive_mutex> guard(this->session_lock_);
+         attrs = sftp_readdir(this->session_, this->dir_);
+         if (attrs == nullptr)
+         {
+            eof = sftp_dir_eof(this->dir_);
+            err = sftp_get_error(this->session_);
+         }
+      }
+
+      lock.lock();
+
+      if (attrs != nullptr)
+         this->ready_.push_back(sftp_file_ptr(new sftp_file(std::move(attrs))));
+      else
+      {
+         if (!eof)
+         {
+            std::stringstream msg;
+            msg << "Error reading directory at '" << this->path_ << "' (SFTP status " << err << ")";
+            this->error_ = msg.str();
+         }
+         this->eof_ = true;
+      }
+
+      this->cv_.notify_all();
+
+      if (this->eof_)
+         return;
+   }
+}
+
+bool directory_stream::next(sftp_file_ptr & entry)
+{
+   std::unique_lock<std::mutex> lock(this->lock_);
+   this->cv_.wait(lock, [this] {return !this->ready_.empty() || this->eof_;});
+
+   if (this->ready_.empty())
+   {
+      if (!this->error_.empty())
+         throw std::logic_error(this->error_);
+      return false;
+   }
+
+   entry = this->ready_.front();
+   this->ready_.pop_front();
+   this->cv_.notify_all();
+   return true;
+}
+
+void directory_stream::close()
+{
+   {
+      std::lock_guard<std::mutex> guard(this->lock_);
+      this->stop_ = true;
+      this->cv_.notify_all();
+   }
+
+   if (this->worker_.joinable())
+      this->worker_.join();
+
+   if (this->dir_ != nullptr)
+   {
+      std::lock_guard<std::recursive_mutex> guard(this->session_lock_);
+      sftp_closedir(this->dir_);
+      this->dir_ = nullptr;
+   }
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef DIRECTORY_STREAM_H
+#define DIRECTORY_STREAM_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <libssh/sftp.h>
+
+#include "sftp_directory.h"
+
+namespace charon {
+
+   // Lists a remote directory on a thread of its own, handing entries
+   // over as each READDIR reply lands instead of after the last one, so
+   // the caller's work on one batch overlaps the round trip for the next.
+   // The session lock is taken per request, leaving other channels on the
+   // link free to run in between.
+   class directory_stream
+   {
+      private :
+         static const size_t DEPTH = 4096;      // entries queued ahead of the caller
+
+         ::sftp_session            session_;
+         std::recursive_mutex &    session_lock_;
+         std::string               path_;
+         ::sftp_dir                dir_;
+
+         std::mutex                lock_;
+         std::condition_variable   cv_;
+         std::deque<sftp_file_ptr> ready_;
+         bool                      eof_;
+         std::string               error_;      // set if the listing broke off
+         bool                      stop_;
+
+         std::thread               worker_;
+
+         void work_routine();
+         void close();
+
+      public :
+
+         directory_stream(::sftp_session session, std::recursive_mutex & session_lock, const std::string & path);
+
+         directory_stream(const directory_stream & rhs) = delete;
+         directory_stream & operator=(const directory_stream & rhs) = delete;
+
+         ~directory_stream();
+
+         // The next entry, or false once there are no more; throws if the
+         // listing failed part way.
+         bool next(sftp_file_ptr & entry);
+   };
+}
+
+#endif // DIRECTORY_STREAM_H
@@ -0,0 +1,428 @@
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <libssh/libssh.h>
+
+#include "known_hosts_index.h"
+#include "local_state.h"
+
+namespace charon {
+
+namespace {
+
+uint64_t fnv1a(const char * data, size_t len)
+{
+   uint64_t h = 14695981039346656037ULL;
+   for (size_t i = 0; i < len; ++i)
+   {
+      h ^= static_cast<unsigned char>(data[i]);
+      h *= 1099511628211ULL;
+   }
+   return h;
+}
+
+}
+
+known_hosts_index::known_hosts_index(const std::string & source)
+   : source_(source),
+     map_(nullptr),
+     map_len_(0)
+{
+   this->file_ = state_path("known_hosts/" + state_key(source));
+
+   this->map();
+   this->refresh();
+}
+
+known_hosts_index::~known_hosts_index()
+{
+   this->unmap();
+}
+
+std::string known_hosts_index::host_name(const std::string & host, int port)
+{
+   if (port == 22)
+      return host;
+
+   std::stringstream name;
+   name << "[" << host << "]:" << port;
+   return name.str();
+}
+
+const known_hosts_index::header * known_hosts_index::head() const
+{
+   return static_cast<const header *>(this->map_);
+}
+
+const known_hosts_index::slot * known_hosts_index::slots() const
+{
+   return reinterpret_cast<const slot *>(static_cast<const char *>(this->map_) + sizeof(header));
+}
+
+const char * known_hosts_index::names() const
+{
+   return reinterpret_cast<const char *>(this->slots() + this->head()->slots_);
+}
+
+void known_hosts_index::map()
+{
+   int fd = ::open(this->file_.c_str(), O_RDONLY);
+   if (fd < 0)
+      return;
+
+   struct stat st;
+   if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(header))
+   {
+      ::close(fd);
+      return;
+   }
+
+   void * addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   ::close(fd);
+   if (addr == MAP_FAILED)
+      return;
+
+   this->map_ = addr;
+   this->map_len_ = st.st_size;
+
+   // Anything but a whole table of ours is as good as no index.
+   const header * h = this->head();
+   if (h->magic_ != MAGIC || h->version_ != VERSION || h->slots_ == 0 ||
+       (h->slots_ & (h->slots_ - 1)) != 0 ||
+       this->map_len_ != sizeof(header) + h->slots_ * sizeof(slot) + h->names_)
+      this->unmap();
+}
+
+void known_hosts_index::unmap()
+{
+   if (this->map_ != nullptr)
+      ::munmap(this->map_, this->map_len_);
+   this->map_ = nullptr;
+   this->map_len_ = 0;
+}
+
+bool known_hosts_index::current(const struct stat & st) const
+{
+   const header * h = this->head();
+   return h != nullptr &&
+          h->ino_ == static_cast<uint64_t>(st.st_ino) &&
+          h->mtime_sec_ == st.st_mtim.tv_sec &&
+          h->mtime_nsec_ == st.st_mtim.tv_nsec &&
+          h->length_ == static_cast<uint64_t>(st.st_size);
+}
+
+void known_hosts_index::refresh()
+{
+   table t;
+
+   struct stat st;
+   if (::stat(this->source_.c_str(), &st) != 0)
+   {
+      if (this->head() != nullptr && this->head()->ino_ == 0)
+         return;
+
+      reset(t);
+      this->store(t);
+      return;
+   }
+
+   if (this->current(st))
+      return;
+
+   std::ifstream in(this->source_, std::ios::binary);
+   if (!in)
+      return;
+
+   // Appended to since we last looked: the bytes before where we stopped
+   // are still the ones we hashed, so only the new lines need reading.
+   uint64_t from = 0;
+   bool incremental = false;
+   const header * h = this->head();
+   if (h != nullptr && h->ino_ == static_cast<uint64_t>(st.st_ino) &&
+       h->parsed_ <= static_cast<uint64_t>(st.st_size))
+   {
+      uint64_t start = (h->parsed_ > TAIL_CHECK) ? h->parsed_ - TAIL_CHECK : 0;
+      std::string tail(h->parsed_ - start, '\0');
+      in.seekg(start);
+      in.read(&tail[0], tail.length());
+      if (in && fnv1a(tail.data(), tail.length()) == h->tail_hash_)
+      {
+         this->load(t);
+         from = h->parsed_;
+         incremental = true;
+      }
+      in.clear();
+   }
+
+   if (!incremental)
+      reset(t);
+
+   in.seekg(from);
+   uint64_t parsed = from;
+   std::string line;
+   while (std::getline(in, line))
+   {
+      // A last line still being written gets read next time.
+      if (in.eof())
+         break;
+
+      parse_line(t, line);
+      parsed += line.length() + 1;
+   }
+   in.clear();
+
+   uint64_t start = (parsed > TAIL_CHECK) ? parsed - TAIL_CHECK : 0;
+   std::string tail(parsed - start, '\0');
+   in.seekg(start);
+   in.read(&tail[0], tail.length());
+
+   t.head_.ino_        = st.st_ino;
+   t.head_.mtime_sec_  = st.st_mtim.tv_sec;
+   t.head_.mtime_nsec_ = st.st_mtim.tv_nsec;
+   t.head_.length_     = st.st_size;
+   t.head_.parsed_     = parsed;
+   t.head_.tail_hash_  = fnv1a(tail.data(), tail.length());
+
+   this->store(t);
+}
+
+void known_hosts_index::reset(table & t)
+{
+   memset(&t.head_, 0, sizeof(t.head_));
+   t.head_.magic_   = MAGIC;
+   t.head_.version_ = VERSION;
+   t.head_.slots_   = MIN_SLOTS;
+
+   slot empty;
+   memset(&empty, 0, sizeof(empty));
+   t.slots_.assign(t.head_.slots_, empty);
+   t.names_.clear();
+}
+
+void known_hosts_index::load(table & t) const
+{
+   if (this->head() == nullptr)
+   {
+      reset(t);
+      return;
+   }
+
+   t.head_ = *this->head();
+   t.slots_.assign(this->slots(), this->slots() + t.head_.slots_);
+   t.names_.assign(this->names(), t.head_.names_);
+}
+
+void known_hosts_index::store(table & t)
+{
+   // Readers elsewhere keep the table they mapped; ours replaces it whole.
+   std::stringstream tmp;
+   tmp << this->file_ << "." << ::getpid() << "." << this;
+   t.head_.names_ = t.names_.length();
+   {
+      std::ofstream out(tmp.str(), std::ios::binary | std::ios::trunc);
+      out.write(reinterpret_cast<const char *>(&t.head_), sizeof(t.head_));
+      out.write(reinterpret_cast<const char *>(t.slots_.data()), t.slots_.size() * sizeof(slot));
+      out.write(t.names_.data(), t.names_.length());
+      if (!out)
+      {
+         std::remove(tmp.str().c_str());
+         return;
+      }
+   }
+
+   if (std::rename(tmp.str().c_str(), this->file_.c_str()) != 0)
+   {
+      std::remove(tmp.str().c_str());
+      return;
+   }
+
+   this->unmap();
+   this->map();
+}
+
+std::string known_hosts_index::normalize(const std::string & host)
+{
+   std::string name(host);
+   for (auto it = name.begin(); it != name.end(); ++it)
+      *it = std::tolower(static_cast<unsigned char>(*it));
+   return name;
+}
+
+uint64_t known_hosts_index::probe_key(const std::string & name, uint16_t flags, const unsigned char * digest)
+{
+   uint64_t h;
+   if (flags & REVOKED)
+      memcpy(&h, digest, sizeof(h));
+   else
+      h = fnv1a(name.data(), name.length());
+   return (h == 0) ? 1 : h;
+}
+
+uint64_t known_hosts_index::find
+(
+   const slot * slots,
+   uint64_t count,
+   const char * names,
+   const std::string & name,
+   uint16_t flags,
+   const unsigned char * digest
+)
+{
+   uint64_t key = probe_key(name, flags, digest);
+   uint64_t mask = count - 1;
+   uint64_t i = key & mask;
+   for (; slots[i].key_ != 0; i = (i + 1) & mask)
+   {
+      const slot & s = slots[i];
+      if (s.key_ == key && s.flags_ == flags &&
+          memcmp(s.digest_, digest, DIGEST_SIZE) == 0 &&
+          name.compare(0, std::string::npos, names + s.name_off_, s.name_len_) == 0)
+         return i;
+   }
+   return i;
+}
+
+void known_hosts_index::insert(table & t, const std::string & name, uint16_t flags, const unsigned char * digest)
+{
+   if (name.length() > UINT16_MAX || t.names_.length() + name.length() > UINT32_MAX)
+      return;
+
+   if ((t.head_.used_ + 1) * 2 > t.head_.slots_)
+   {
+      std::vector<slot> old;
+      old.swap(t.slots_);
+
+      slot empty;
+      memset(&empty, 0, sizeof(empty));
+      t.head_.slots_ *= 2;
+      t.slots_.assign(t.head_.slots_, empty);
+
+      // Names stay where they are in names_; only the slots move.
+      uint64_t mask = t.head_.slots_ - 1;
+      for (auto it = old.begin(); it != old.end(); ++it)
+      {
+         if (it->key_ == 0)
+            continue;
+
+         uint64_t i = it->key_ & mask;
+         while (t.slots_[i].key_ != 0)
+            i = (i + 1) & mask;
+         t.slots_[i] = *it;
+      }
+   }
+
+   slot & s = t.slots_[find(t.slots_.data(), t.head_.slots_, t.names_.data(), name, flags, digest)];
+   if (s.key_ != 0)
+      return;
+
+   s.key_      = probe_key(name, flags, digest);
+   s.name_off_ = static_cast<uint32_t>(t.names_.length());
+   s.name_len_ = static_cast<uint16_t>(name.length());
+   s.flags_    = flags;
+   memcpy(s.digest_, digest, DIGEST_SIZE);
+
+   t.names_ += name;
+   ++t.head_.used_;
+}
+
+void known_hosts_index::parse_line(table & t, const std::string & line)
+{
+   std::istringstream fields(line);
+   std::string hosts, type, blob;
+   if (!(fields >> hosts) || hosts[0] == '#')
+      return;
+
+   // A revoked key is refused for every host, so its patterns don't
+   // matter; @cert-authority lines are left to libssh.
+   uint16_t flags = 0;
+   if (hosts[0] == '@')
+   {
+      if (hosts != "@revoked" || !(fields >> hosts))
+         return;
+      flags = REVOKED;
+   }
+
+   if (!(fields >> type >> blob))
+      return;
+
+   // Hashed names and lines with negations are left to libssh.
+   if (flags == 0 &&
+       (hosts.compare(0, 3, "|1|") == 0 || hosts.find('!') != std::string::npos))
+      return;
+
+   enum ssh_keytypes_e key_type = ssh_key_type_from_name(type.c_str());
+   if (key_type == SSH_KEYTYPE_UNKNOWN)
+      return;
+
+   ssh_key key = nullptr;
+   if (ssh_pki_import_pubkey_base64(blob.c_str(), key_type, &key) != SSH_OK)
+      return;
+
+   unsigned char * hash = nullptr;
+   size_t hlen = 0;
+   int rc = ssh_get_publickey_hash(key, SSH_PUBLICKEY_HASH_SHA256, &hash, &hlen);
+   ssh_key_free(key);
+   if (rc != SSH_OK)
+      return;
+
+   if (hlen == DIGEST_SIZE && (flags & REVOKED))
+   {
+      insert(t, std::string(), REVOKED, hash);
+   }
+   else if (hlen == DIGEST_SIZE)
+   {
+      std::istringstream names(hosts);
+      std::string name;
+      while (std::getline(names, name, ','))
+      {
+         if (name.empty() || name.find_first_of("*?") != std::string::npos)
+            continue;
+         insert(t, normalize(name), 0, hash);
+      }
+   }
+
+   ssh_clean_pubkey_hash(&hash);
+}
+
+bool known_hosts_index::contains(const std::string & host, const unsigned char * digest) const
+{
+   const header * h = this->head();
+   if (h == nullptr || h->used_ == 0 || this->revoked(digest))
+      return false;
+
+   const slot * table = this->slots();
+   return table[find(table, h->slots_, this->names(), normalize(host), 0, digest)].key_ != 0;
+}
+
+bool known_hosts_index::revoked(const unsigned char * digest) const
+{
+   const header * h = this->head();
+   if (h == nullptr || h->used_ == 0)
+      return false;
+
+   const slot * table = this->slots();
+   return table[find(table, h->slots_, this->names(), std::string(), REVOKED, digest)].key_ != 0;
+}
+
+void known_hosts_index::learn(const std::string & host, const unsigned char * digest)
+{
+   // Pick up whatever libssh just appended before adding to it.
+   this->refresh();
+
+   if (this->revoked(digest) || this->contains(host, digest))
+      return;
+
+   table t;
+   this->load(t);
+   insert(t, normalize(host), 0, digest);
+   this->store(t);
+}
+
+}
@@ -0,0 +1,134 @@
+#ifndef KNOWN_HOSTS_INDEX_H
+#define KNOWN_HOSTS_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace charon {
+
+   // Constant-time host key lookups against a known_hosts file, through
+   // an open-addressed table of (host, key digest) pairs kept under
+   // $HOME/.charon/known_hosts and mapped read-only. Plain host names are
+   // indexed as the file is read; hashed (|1|) entries can't be reversed,
+   // so those hosts are added once libssh has matched them. Keys on
+   // @revoked lines are indexed whatever their host patterns say, and are
+   // refused outright. Lines appended since the last look are indexed
+   // incrementally, and any other change to the file rebuilds the index.
+   // A miss only means "ask libssh", never "unknown".
+   class known_hosts_index
+   {
+      public :
+
+         static const size_t DIGEST_SIZE = 32;      // SHA-256 of the key blob
+
+      private :
+
+         static const uint32_t MAGIC        = 0x43484b49;   // "CHKI"
+         static const uint32_t VERSION      = 2;
+         static const size_t   MIN_SLOTS    = 1024;
+         static const size_t   TAIL_CHECK   = 256;          // bytes compared before an incremental update
+
+         struct header
+         {
+            uint32_t magic_;
+            uint32_t version_;
+            uint64_t ino_;            // of the known_hosts file indexed
+            int64_t  mtime_sec_;
+            int64_t  mtime_nsec_;
+            uint64_t length_;
+            uint64_t parsed_;         // offset just past the last complete line
+            uint64_t tail_hash_;      // of the TAIL_CHECK bytes before parsed_
+            uint64_t slots_;          // a power of two
+            uint64_t used_;
+            uint64_t names_;          // bytes of host names after the slots
+         };
+
+         static const uint16_t REVOKED = 1;
+
+         // Hosts are told apart by their whole name; key_ only picks where
+         // probing starts (the name's hash, or the digest's when revoked).
+         struct slot
+         {
+            uint64_t      key_;       // 0 when empty
+            uint32_t      name_off_;
+            uint16_t      name_len_;
+            uint16_t      flags_;
+            unsigned char digest_[DIGEST_SIZE];
+         };
+
+         struct table
+         {
+            header            head_;
+            std::vector<slot> slots_;
+            std::string       names_;
+         };
+
+         std::string source_;
+         std::string file_;
+         void *      map_;
+         size_t      map_len_;
+
+         const header * head() const;
+         const slot *   slots() const;
+         const char *   names() const;
+
+         void map();
+         void unmap();
+         bool current(const struct stat & st) const;
+
+         // Brings the index up to date with source_, parsing only what was
+         // appended where it can.
+         void refresh();
+
+         static void reset(table & t);
+         void load(table & t) const;
+         void store(table & t);
+
+         static std::string normalize(const std::string & host);
+         static uint64_t    probe_key(const std::string & name, uint16_t flags, const unsigned char * digest);
+
+         // Index of the slot holding this entry, or of the empty slot
+         // ending its probe sequence.
+         static uint64_t find
+         (
+            const slot * slots,
+            uint64_t count,
+            const char * names,
+            const std::string & name,
+            uint16_t flags,
+            const unsigned char * digest
+         );
+
+         static void insert(table & t, const std::string & name, uint16_t flags, const unsigned char * digest);
+         static void parse_line(table & t, const std::string & line);
+
+      public :
+
+         explicit known_hosts_index(const std::string & source);
+
+         known_hosts_index(const known_hosts_index & rhs) = delete;
+         known_hosts_index & operator=(const known_hosts_index & rhs) = delete;
+
+         ~known_hosts_index();
+
+         // host as libssh writes it: "name", or "[name]:port" off port 22.
+         static std::string host_name(const std::string & host, int port);
+
+         // Whether source lists the key with this digest for host (and
+         // hasn't revoked it).
+         bool contains(const std::string & host, const unsigned char * digest) const;
+
+         // Whether source has an @revoked line for the key with this digest.
+         bool revoked(const unsigned char * digest) const;
+
+         // Add a match libssh made itself, or a key it has just appended;
+         // revoked keys are never added.
+         void learn(const std::string & host, const unsigned char * digest);
+   };
+}
+
+#endif // KNOWN_HOSTS_INDEX_H
@@ -0,0 +1,762 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef CHARON_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "local_io.h"
+#include "prefetch_reader.h"
+
+namespace charon {
+
+namespace {
+
+const mode_t CREATE_MODE = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+
+// Granularity of zero detection for sparse writes; a typical fs block.
+const uint64_t HOLE_BLOCK = 4096;
+
+bool is_zero(const char * buf, size_t len)
+{
+   return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+int open_flags(local_io::open_mode mode)
+{
+   switch (mode)
+   {
+      case local_io::WRITE:
+         return O_WRONLY | O_CREAT;
+      case local_io::WRITE_TRUNCATE:
+         return O_WRONLY | O_CREAT | O_TRUNC;
+      case local_io::READ:
+      default:
+         return O_RDONLY;
+   }
+}
+
+ssize_t pread_fully(int fd, char * buf, size_t len, uint64_t offset)
+{
+   size_t total = 0;
+   while (total < len)
+   {
+      ssize_t rc = ::pread(fd, buf + total, len - total, offset + total);
+      if (rc < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+
+      if (rc == 0)
+         break;
+
+      total += rc;
+   }
+
+   return static_cast<ssize_t>(total);
+}
+
+ssize_t pwrite_fully(int fd, const char * buf, size_t len, uint64_t offset)
+{
+   size_t total = 0;
+   while (total < len)
+   {
+      ssize_t rc = ::pwrite(fd, buf + total, len - total, offset + total);
+      if (rc < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return -1;
+      }
+
+      total += rc;
+   }
+
+   return static_cast<ssize_t>(total);
+}
+
+// Plain positional I/O through the page cache.
+class posix_io : public local_io
+{
+   public :
+
+      posix_io(int fd, const std::string & path, local_io::open_mode mode)
+         : local_io(fd, path)
+      {
+         if (mode == local_io::READ)
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      }
+
+      ssize_t read(char * buf, size_t len, uint64_t offset)
+      {
+         return pread_fully(this->fd_, buf, len, offset);
+      }
+
+      ssize_t write(const char * buf, size_t len, uint64_t offset)
+      {
+         return pwrite_fully(this->fd_, buf, len, offset);
+      }
+};
+
+// Reads straight out of a shared read-only mapping of the whole file;
+// writes go through pwrite() since the final size isn't known up front.
+class mmap_io : public posix_io
+{
+   private :
+      char *   map_;
+      uint64_t size_;
+
+   public :
+
+      mmap_io(int fd, const std::string & path, local_io::open_mode mode)
+         : posix_io(fd, path, mode),
+           map_(nullptr),
+           size_(0)
+      {
+         struct stat st;
+         if (mode != local_io::READ || ::fstat(fd, &st) != 0 || st.st_size == 0)
+            return;
+
+         void * map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+         if (map == MAP_FAILED)
+            return;      // pread() fallback
+
+         ::madvise(map, st.st_size, MADV_SEQUENTIAL);
+         this->map_  = static_cast<char *>(map);
+         this->size_ = static_cast<uint64_t>(st.st_size);
+      }
+
+      ~mmap_io()
+      {
+         if (this->map_ != nullptr)
+            ::munmap(this->map_, this->size_);
+      }
+
+      ssize_t read(char * buf, size_t len, uint64_t offset)
+      {
+         if (this->map_ == nullptr)
+            return posix_io::read(buf, len, offset);
+
+         if (offset >= this->size_)
+            return 0;
+
+         size_t cnt = static_cast<size_t>(std::min<uint64_t>(len, this->size_ - offset));
+         memcpy(buf, this->map_ + offset, cnt);
+         return static_cast<ssize_t>(cnt);
+      }
+};
+
+// O_DIRECT through an aligned bounce buffer.  Reads are widened to the
+// enclosing aligned span; writes that aren't block aligned (the tail of
+// a file, short replies) go through a second, buffered descriptor.
+class direct_io : public local_io
+{
+   private :
+      static const size_t ALIGN = 4096;
+
+      int     buffered_fd_;
+      char *  bounce_;
+      size_t  bounce_size_;
+
+      bool reserve(size_t len)
+      {
+         if (len <= this->bounce_size_)
+            return true;
+
+         void * mem = nullptr;
+         if (::posix_memalign(&mem, ALIGN, len) != 0)
+            return false;
+
+         free(this->bounce_);
+         this->bounce_ = static_cast<char *>(mem);
+         this->bounce_size_ = len;
+         return true;
+      }
+
+   public :
+
+      direct_io(int fd, int buffered_fd, const std::string & path)
+         : local_io(fd, path),
+           buffered_fd_(buffered_fd),
+           bounce_(nullptr),
+           bounce_size_(0)
+      {}
+
+      ~direct_io()
+      {
+         if (this->buffered_fd_ >= 0)
+            ::close(this->buffered_fd_);
+         free(this->bounce_);
+      }
+
+      ssize_t read(char * buf, size_t len, uint64_t offset)
+      {
+         uint64_t start = offset & ~static_cast<uint64_t>(ALIGN - 1);
+         uint64_t end   = (offset + len + ALIGN - 1) & ~static_cast<uint64_t>(ALIGN - 1);
+         size_t span    = static_cast<size_t>(end - start);
+
+         if (!this->reserve(span))
+            return -1;
+
+         // Every pread on the O_DIRECT descriptor has to stay aligned, and
+         // one at EOF may fail with EINVAL rather than return 0; so only a
+         // block-aligned count is read on from, and any other short count
+         // is the end of the file.
+         ssize_t rc = 0;
+         while (static_cast<size_t>(rc) < span)
+         {
+            ssize_t got = ::pread(this->fd_, this->bounce_ + rc, span - rc, start + rc);
+            if (got < 0 && errno == EINTR)
+               continue;
+            if (got < 0)
+               return -1;
+
+            rc += got;
+            if (got == 0 || (got % ALIGN) != 0)
+               break;
+         }
+
+         size_t skip = static_cast<size_t>(offset - start);
+         if (static_cast<size_t>(rc) <= skip)
+            return 0;
+
+         size_t cnt = std::min(len, static_cast<size_t>(rc) - skip);
+         memcpy(buf, this->bounce_ + skip, cnt);
+         return static_cast<ssize_t>(cnt);
+      }
+
+      ssize_t write(const char * buf, size_t len, uint64_t offset)
+      {
+         if ((offset % ALIGN) != 0 || (len % ALIGN) != 0 || !this->reserve(len))
+            return pwrite_fully(this->buffered_fd_, buf, len, offset);
+
+         memcpy(this->bounce_, buf, len);
+         return pwrite_fully(this->fd_, this->bounce_, len, offset);
+      }
+
+      bool close()
+      {
+         if (this->buffered_fd_ >= 0 && ::close(this->buffered_fd_) != 0)
+         {
+            this->buffered_fd_ = -1;
+            local_io::close();
+            return false;
+         }
+         this->buffered_fd_ = -1;
+
+         return local_io::close();
+      }
+};
+
+#ifdef CHARON_HAVE_LIBURING
+// Keeps DEPTH block reads (uploads) or writes (downloads) queued on an
+// io_uring, so the disk works while the network side waits on the server.
+class uring_io : public local_io
+{
+   private :
+      static const size_t   DEPTH      = 16;
+      static const size_t   BLOCK_SIZE = 1 << 20;
+
+      struct slot
+      {
+         uint64_t                offset_;
+         size_t                  length_;
+         ssize_t                 result_;
+         uint64_t                seq_;          // submission order of a write
+         bool                    busy_;
+         bool                    done_;
+         std::unique_ptr<char[]> data_;
+      };
+
+      // A when_written() call waiting on the writes submitted before it.
+      struct waiter
+      {
+         uint64_t     seq_;
+         uint64_t     offset_;
+         uint64_t     length_;
+         written_fn   done_;
+      };
+
+      struct io_uring      ring_;
+      bool                 writing_;
+      slot                 slots_[DEPTH];
+      uint64_t             next_;         // next read-ahead offset
+      bool                 eof_;
+      bool                 failed_;
+      uint64_t             submitted_;    // writes queued so far
+      std::deque<waiter>   waiters_;
+
+      // Every write with a lower sequence number has completed.
+      uint64_t settled() const
+      {
+         uint64_t seq = this->submitted_;
+         for (size_t i = 0; i < DEPTH; ++i)
+            if (this->slots_[i].busy_ && !this->slots_[i].done_ && this->slots_[i].seq_ < seq)
+               seq = this->slots_[i].seq_;
+         return seq;
+      }
+
+      void notify()
+      {
+         if (this->failed_)
+         {
+            this->waiters_.clear();
+            return;
+         }
+
+         uint64_t seq = this->settled();
+         while (!this->waiters_.empty() && this->waiters_.front().seq_ <= seq)
+         {
+            waiter w = std::move(this->waiters_.front());
+            this->waiters_.pop_front();
+            w.done_(w.offset_, w.length_);
+         }
+      }
+
+      bool reap(bool wait)
+      {
+         struct io_uring_cqe * cqe = nullptr;
+         int rc = wait ? io_uring_wait_cqe(&this->ring_, &cqe)
+                       : io_uring_peek_cqe(&this->ring_, &cqe);
+         if (rc != 0 || cqe == nullptr)
+            return false;
+
+         slot * s = static_cast<slot *>(io_uring_cqe_get_data(cqe));
+         s->result_ = cqe->res;
+         s->done_   = true;
+         io_uring_cqe_seen(&this->ring_, cqe);
+
+         if (this->writing_)
+         {
+            if (s->result_ < 0 || static_cast<size_t>(s->result_) != s->length_)
+               this->failed_ = true;
+            this->notify();
+         }
+
+         return true;
+      }
+
+      // Wait out everything in flight and free every slot.
+      void drain()
+      {
+         for (size_t i = 0; i < DEPTH; ++i)
+         {
+            while (this->slots_[i].busy_ && !this->slots_[i].done_)
+            {
+               if (!this->reap(true))
+               {
+                  // Whatever that write did is unknown from here on.
+                  if (this->writing_)
+                     this->failed_ = true;
+                  break;
+               }
+            }
+
+            this->slots_[i].busy_ = false;
+            this->slots_[i].done_ = false;
+         }
+      }
+
+      // Queue read-ahead into every free slot.
+      void fill()
+      {
+         if (this->eof_)
+            return;
+
+         size_t queued = 0;
+         for (size_t i = 0; i < DEPTH; ++i)
+         {
+            slot & s = this->slots_[i];
+            if (s.busy_)
+               continue;
+
+            struct io_uring_sqe * sqe = io_uring_get_sqe(&this->ring_);
+            io_uring_prep_read(sqe, this->fd_, s.data_.get(), BLOCK_SIZE, this->next_);
+            io_uring_sqe_set_data(sqe, &s);
+
+            s.offset_ = this->next_;
+            s.length_ = BLOCK_SIZE;
+            s.busy_   = true;
+            s.done_   = false;
+
+            this->next_ += BLOCK_SIZE;
+            ++queued;
+         }
+
+         if (queued > 0)
+            io_uring_submit(&this->ring_);
+      }
+
+   public :
+
+      uring_io(int fd, const std::string & path, local_io::open_mode mode)
+         : local_io(fd, path),
+           writing_(mode != local_io::READ),
+           next_(0),
+           eof_(false),
+           failed_(false),
+           submitted_(0)
+      {
+         if (io_uring_queue_init(DEPTH, &this->ring_, 0) != 0)
+         {
+            this->fd_ = -1;      // caller still owns fd
+            throw std::runtime_error("io_uring unavailable");
+         }
+
+         for (size_t i = 0; i < DEPTH; ++i)
+         {
+            this->slots_[i].busy_ = false;
+            this->slots_[i].done_ = false;
+            this->slots_[i].seq_  = 0;
+            this->slots_[i].data_.reset(new char[BLOCK_SIZE]);
+         }
+      }
+
+      ~uring_io()
+      {
+         // Nobody is left to tell once we are being torn down.
+         this->waiters_.clear();
+         this->drain();
+         io_uring_queue_exit(&this->ring_);
+      }
+
+      ssize_t read(char * buf, size_t len, uint64_t offset)
+      {
+         size_t copied = 0;
+         while (copied < len)
+         {
+            uint64_t pos = offset + copied;
+            uint64_t base = pos - (pos % BLOCK_SIZE);
+
+            slot * hit = nullptr;
+            for (size_t i = 0; i < DEPTH && hit == nullptr; ++i)
+               if (this->slots_[i].busy_ && this->slots_[i].offset_ == base)
+                  hit = &this->slots_[i];
+
+            if (hit == nullptr)
+            {
+               if (this->eof_ && base >= this->next_)
+                  break;
+
+               // Not read ahead (first call, or a seek); restart from here.
+               this->drain();
+               this->next_ = base;
+               this->eof_ = false;
+               this->fill();
+               continue;
+            }
+
+            while (!hit->done_)
+               if (!this->reap(true))
+                  return -1;
+
+            if (hit->result_ < 0)
+               return -1;
+
+            size_t avail = static_cast<size_t>(hit->result_);
+            size_t skip = static_cast<size_t>(pos - base);
+            if (avail <= skip)
+            {
+               this->eof_ = true;
+               break;
+            }
+
+            size_t cnt = std::min(len - copied, avail - skip);
+            memcpy(buf + copied, hit->data_.get() + skip, cnt);
+            copied += cnt;
+
+            if (avail < BLOCK_SIZE)
+            {
+               this->eof_ = true;
+               if (skip + cnt == avail)
+                  break;
+            }
+            else if (skip + cnt == avail)
+            {
+               // Block consumed; recycle its slot further ahead.
+               hit->busy_ = false;
+               hit->done_ = false;
+               this->fill();
+            }
+         }
+
+         return static_cast<ssize_t>(copied);
+      }
+
+      ssize_t write(const char * buf, size_t len, uint64_t offset)
+      {
+         // Write-behind: copy into a free slot and queue it.
+         size_t written = 0;
+         while (written < len)
+         {
+            if (this->failed_)
+               return -1;
+
+            slot * s = nullptr;
+            for (size_t i = 0; i < DEPTH && s == nullptr; ++i)
+               if (!this->slots_[i].busy_ || this->slots_[i].done_)
+                  s = &this->slots_[i];
+
+            if (s == nullptr)
+            {
+               if (!this->reap(true))
+                  return -1;
+               continue;
+            }
+
+            size_t cnt = std::min(len - written, static_cast<size_t>(BLOCK_SIZE));
+            memcpy(s->data_.get(), buf + written, cnt);
+
+            struct io_uring_sqe * sqe = io_uring_get_sqe(&this->ring_);
+            io_uring_prep_write(sqe, this->fd_, s->data_.get(), cnt, offset + written);
+            io_uring_sqe_set_data(sqe, s);
+
+            s->offset_ = offset + written;
+            s->length_ = cnt;
+            s->seq_    = this->submitted_++;
+            s->busy_   = true;
+            s->done_   = false;
+
+            io_uring_submit(&this->ring_);
+            written += cnt;
+
+            while (this->reap(false))
+               ;
+         }
+
+         return this->failed_ ? -1 : static_cast<ssize_t>(written);
+      }
+
+      void when_written(uint64_t offset, uint64_t length, const written_fn & done)
+      {
+         if (this->failed_)
+            return;
+
+         this->waiters_.push_back({this->submitted_, offset, length, done});
+         this->notify();
+      }
+
+      bool close()
+      {
+         this->drain();
+         bool ok = local_io::close();
+         return ok && !this->failed_;
+      }
+};
+#endif
+
+}
+
+local_io::local_io(int fd, const std::string & path)
+   : fd_(fd),
+     path_(path)
+{
+}
+
+local_io::~local_io()
+{
+   if (this->fd_ >= 0)
+      ::close(this->fd_);
+}
+
+bool local_io::close()
+{
+   int rc = 0;
+   if (this->fd_ >= 0)
+      rc = ::close(this->fd_);
+
+   this->fd_ = -1;
+   return rc == 0;
+}
+
+ssize_t local_io::write_sparse(const char * buf, size_t len, uint64_t offset)
+{
+   const uint64_t end = offset + len;
+   uint64_t pos = offset;
+
+   while (pos < end)
+   {
+      // Coalesce block-aligned runs that are all zero, or all not.
+      uint64_t run_end = std::min(end, (pos / HOLE_BLOCK + 1) * HOLE_BLOCK);
+      bool zero = is_zero(buf + (pos - offset), run_end - pos);
+
+      while (run_end < end)
+      {
+         uint64_t next = std::min(end, run_end + HOLE_BLOCK);
+         if (is_zero(buf + (run_end - offset), next - run_end) != zero)
+            break;
+         run_end = next;
+      }
+
+      size_t run = static_cast<size_t>(run_end - pos);
+      if (!zero)
+      {
+         if (this->write(buf + (pos - offset), run, pos) != static_cast<ssize_t>(run))
+            return -1;
+      }
+      else
+      {
+#ifdef FALLOC_FL_PUNCH_HOLE
+         int rc = ::fallocate(this->fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, run);
+#else
+         int rc = -1;
+#endif
+         // No hole punching here; zeros only need writing over existing data.
+         if (rc != 0 && this->next_data(pos) < run_end)
+         {
+            static const char zeros[HOLE_BLOCK] = {0};
+            for (uint64_t at = pos; at < run_end; )
+            {
+               size_t cnt = static_cast<size_t>(std::min(run_end - at, HOLE_BLOCK));
+               if (this->write(zeros, cnt, at) != static_cast<ssize_t>(cnt))
+                  return -1;
+               at += cnt;
+            }
+         }
+      }
+
+      pos = run_end;
+   }
+
+   return static_cast<ssize_t>(len);
+}
+
+void local_io::when_written(uint64_t offset, uint64_t length, const written_fn & done)
+{
+   done(offset, length);
+}
+
+bool local_io::preallocate(uint64_t size, bool sparse)
+{
+   // Blocks reserved for a sparse file would only be punched out again
+   // by write_sparse(); the size alone will do.
+   if (!sparse && ::fallocate(this->fd_, 0, 0, size) == 0)
+      return true;
+
+   // ENOSPC (a sparse file may still fit), EOPNOTSUPP, ...: just set the size.
+   struct stat st;
+   if (::fstat(this->fd_, &st) != 0)
+      return false;
+
+   return static_cast<uint64_t>(st.st_size) >= size || ::ftruncate(this->fd_, size) == 0;
+}
+
+uint64_t local_io::next_data(uint64_t offset) const
+{
+   off_t pos = ::lseek(this->fd_, offset, SEEK_DATA);
+   if (pos >= 0)
+      return static_cast<uint64_t>(pos);
+
+   return (errno == ENXIO) ? static_cast<uint64_t>(NO_DATA) : offset;
+}
+
+uint64_t local_io::next_hole(uint64_t offset) const
+{
+   off_t pos = ::lseek(this->fd_, offset, SEEK_HOLE);
+   return (pos >= 0) ? static_cast<uint64_t>(pos) : static_cast<uint64_t>(NO_DATA);
+}
+
+local_io::io_ptr local_io::open(const std::string & path, open_mode mode, io_backend backend)
+{
+   int flags = open_flags(mode);
+   io_ptr io;
+
+   if (backend == IO_DIRECT)
+   {
+      int fd = ::open(path.c_str(), flags | O_DIRECT, CREATE_MODE);
+      if (fd < 0 && errno != EINVAL)
+         return io_ptr();
+
+      if (fd >= 0)
+      {
+         // Second, buffered descriptor for unaligned writes; never truncate twice.
+         int buffered = -1;
+         if (mode != READ)
+         {
+            buffered = ::open(path.c_str(), O_WRONLY);
+            if (buffered < 0)
+            {
+               ::close(fd);
+               return io_ptr();
+            }
+         }
+
+         io.reset(new direct_io(fd, buffered, path));
+      }
+      else
+         backend = IO_PREAD;     // filesystem refuses O_DIRECT (tmpfs et al.)
+   }
+
+   if (!io)
+   {
+      int fd = ::open(path.c_str(), flags, CREATE_MODE);
+      if (fd < 0)
+         return io_ptr();
+
+#ifdef CHARON_HAVE_LIBURING
+      if (backend == IO_URING)
+      {
+         try
+         {
+            // Queues its own read-ahead; no prefetch stage needed.
+            return io_ptr(new uring_io(fd, path, mode));
+         }
+         catch (const std::runtime_error &)
+         {
+            backend = IO_PREAD;     // e.g. io_uring disabled by seccomp
+         }
+      }
+#endif
+
+      if (backend == IO_MMAP)
+         io.reset(new mmap_io(fd, path, mode));
+      else
+         io.reset(new posix_io(fd, path, mode));
+   }
+
+   if (mode == READ)
+      io.reset(new prefetch_reader(std::move(io)));
+
+   return io;
+}
+
+io_backend local_io::parse_backend(const std::string & name)
+{
+   if (name == "pread")
+      return IO_PREAD;
+   if (name == "mmap")
+      return IO_MMAP;
+   if (name == "uring" || name == "io_uring")
+      return IO_URING;
+   if (name == "direct")
+      return IO_DIRECT;
+
+   throw std::invalid_argument("Unknown I/O backend '" + name + "' (pread, mmap, uring, direct)");
+}
+
+const char * local_io::backend_name(io_backend backend)
+{
+   switch (backend)
+   {
+      case IO_MMAP:   return "mmap";
+      case IO_URING:  return "uring";
+      case IO_DIRECT: return "direct";
+      case IO_PREAD:
+      default:        return "pread";
+   }
+}
+
+}
@@ -0,0 +1,85 @@
+#ifndef LOCAL_IO_H
+#define LOCAL_IO_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <sys/types.h>
+
+#include "transfer_options.h"
+
+namespace charon {
+
+   // Local side of a transfer: positional reads for uploads, positional
+   // writes for downloads.
+   class local_io
+   {
+      protected :
+         int         fd_;
+         std::string path_;
+
+         local_io(int fd, const std::string & path);
+
+      public :
+
+         enum open_mode
+         {
+            READ           = 0,
+            WRITE          = 1,     // create if missing, keep contents
+            WRITE_TRUNCATE = 2
+         };
+
+         using io_ptr = std::unique_ptr<local_io>;
+         using written_fn = std::function<void(uint64_t, uint64_t)>;
+
+         // Opens path with the requested backend; uploads through a
+         // synchronous backend get a prefetch stage in front of it.
+         static io_ptr open(const std::string & path, open_mode mode, io_backend backend);
+
+         static io_backend parse_backend(const std::string & name);
+         static const char * backend_name(io_backend backend);
+
+         local_io(const local_io & rhs) = delete;
+         local_io & operator=(const local_io & rhs) = delete;
+
+         virtual ~local_io();
+
+         // Up to len bytes at offset, short only at EOF; -1 on error.
+         virtual ssize_t read(char * buf, size_t len, uint64_t offset) = 0;
+
+         // All len bytes at offset; -1 on error.
+         virtual ssize_t write(const char * buf, size_t len, uint64_t offset) = 0;
+
+         // Like write(), but runs of all-zero blocks are left as (or
+         // punched into) holes instead of being written.
+         ssize_t write_sparse(const char * buf, size_t len, uint64_t offset);
+
+         // Calls done(offset, length) once every write issued so far has
+         // reached the file: at once for synchronous backends, only after
+         // their completions for write-behind, and never if one failed.
+         virtual void when_written(uint64_t offset, uint64_t length, const written_fn & done);
+
+         // Sizes the file up front, reserving its blocks with fallocate()
+         // where the filesystem allows unless it is to be written sparse;
+         // false if it couldn't be resized.
+         bool preallocate(uint64_t size, bool sparse);
+
+         // SEEK_DATA / SEEK_HOLE: start of the next data extent at or after
+         // offset (NO_DATA if only a hole remains), and the end of the extent
+         // holding offset. Without support the whole file counts as data.
+         static const uint64_t NO_DATA = UINT64_MAX;
+
+         uint64_t next_data(uint64_t offset) const;
+         uint64_t next_hole(uint64_t offset) const;
+
+         // Completes outstanding writes and releases the file.
+         virtual bool close();
+
+         int fd() const {return this->fd_;}
+         const std::string & path() const {return this->path_;}
+   };
+}
+
+#endif // LOCAL_IO_H
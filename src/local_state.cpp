@@ -0,0 +1,67 @@
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+
+#include <errno.h>
+#include <limits.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "local_state.h"
+
+namespace charon {
+
+std::string state_path(const std::string & name)
+{
+   const char * home = ::getenv("HOME");
+   if (home == nullptr)
+   {
+      struct passwd * pw = ::getpwuid(::getuid());
+      if (pw == nullptr)
+         throw std::runtime_error("Couldn't determine home directory for charon state.");
+      home = pw->pw_dir;
+   }
+
+   std::string path = std::string(home) + "/.charon/" + name;
+
+   // mkdir -p everything up to the last component
+   for (auto slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+   {
+      std::string dir = path.substr(0, slash);
+      if (::mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST)
+         throw std::runtime_error("Couldn't create charon state directory '" + dir + "'");
+   }
+
+   return path;
+}
+
+std::string absolute_path(const std::string & path)
+{
+   if ((path.length() > 0) && (path[0] == '/'))
+      return path;
+
+   char cwd[PATH_MAX];
+   if (::getcwd(cwd, sizeof(cwd)) == nullptr)
+      return path;
+
+   return std::string(cwd) + "/" + path;
+}
+
+std::string state_key(const std::string & key)
+{
+   uint64_t h = 14695981039346656037ULL;
+   for (auto it = key.begin(); it != key.end(); ++it)
+   {
+      h ^= static_cast<unsigned char>(*it);
+      h *= 1099511628211ULL;
+   }
+
+   std::stringstream ss;
+   ss << std::hex << h;
+   return ss.str();
+}
+
+}
@@ -0,0 +1,19 @@
+#ifndef LOCAL_STATE_H
+#define LOCAL_STATE_H
+
+#include <string>
+
+namespace charon {
+
+   // Path of a file or directory under charon's per-user state directory
+   // ($HOME/.charon), creating the directories leading up to it.
+   std::string state_path(const std::string & name);
+
+   // Absolute form of a local path, which need not exist yet.
+   std::string absolute_path(const std::string & path);
+
+   // Stable (FNV-1a) hex digest of key, for naming per-object state files.
+   std::string state_key(const std::string & key);
+}
+
+#endif // LOCAL_STATE_H
@@ -1,6 +1,10 @@
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include <unistd.h>
 
 //#include "../app/logging/log_util.h"
 #include <libssh/libsshpp.hpp>
@@ -8,13 +12,360 @@
 //#include "../core/datetime/date_time.h"
 
 #include "arg_parser.h"
+#include "batch_runner.h"
 #include "cmd_parser.h"
+#include "compression_router.h"
+#include "control_master.h"
+#include "delta_sync.h"
 #include "sftp_connection.h"
 #include "sftp_directory.h"
 #include "sftp_server.h"
+#include "striped_transfer.h"
+#include "transfer_scheduler.h"
 
 using string_util = sk3l::core::text::string_util;
 
+namespace {
+
+// Shared by every command, whichever connection it runs on.
+struct shell
+{
+   charon::sftp_server &        server_;
+   charon::striped_transfer &   striper_;
+   charon::transfer_scheduler & scheduler_;
+};
+
+// Runs one command on conn; false if it was rejected or unrecognised.
+bool run_command
+(
+   shell & sh,
+   charon::sftp_connection & conn,
+   charon::compression_router & compressor,
+   charon::cmd_data & cmd_to_do,
+   std::ostream & out,
+   std::ostream & err
+)
+{
+   switch (cmd_to_do.type_)
+   {
+      case charon::cmd_type::HELP:
+         out << "Help is coming..." << std::endl;
+      break;
+
+      case charon::cmd_type::LIST:
+      {
+         std::string path;
+         if (cmd_to_do.parameters_.size() > 0)
+            path = string_util::strip_ws(cmd_to_do.parameters_[0]);
+         else
+            path = "./";         // default to current directory
+
+         charon::print_listing_header(out);
+         conn.list_directory(path, [&out](const charon::sftp_file_ptr & f) {out << *f;});
+      }
+      break;
+
+      case charon::PWD:
+         out << "Current working directory is " << conn.get_working_directory() << std::endl;
+      break;
+
+      case charon::CD:
+      {
+         std::string path;
+         if (cmd_to_do.parameters_.size() > 0)
+            path = string_util::strip_ws(cmd_to_do.parameters_[0]);
+         else
+            path = "./";         // default to current directory
+
+         conn.change_directory(path);
+         out << "Changed directory to " << path << std::endl;
+      }
+      break;
+
+      case charon::STAT:
+      {
+         std::string path;
+         if (cmd_to_do.parameters_.size() > 0)
+            path = string_util::strip_ws(cmd_to_do.parameters_[0]);
+         else
+         {
+            err << "Must provide argument to stat (e.g. stat <foo>)"
+                      << std::endl;
+            return false;
+         }
+
+         charon::sftp_file f = conn.stat(path);
+         f.print_stat(out);
+      }
+      break;
+
+      case charon::cmd_type::PUT:
+      {
+         bool resume = false;
+         bool recursive = false;
+         while (cmd_to_do.parameters_.size() > 0 &&
+                (cmd_to_do.parameters_[0] == "-r" || cmd_to_do.parameters_[0] == "-R"))
+         {
+            if (cmd_to_do.parameters_[0] == "-r")
+               resume = true;
+            else
+               recursive = true;
+            cmd_to_do.parameters_.erase(cmd_to_do.parameters_.begin());
+         }
+
+         size_t argcnt = cmd_to_do.parameters_.size();
+
+         if (argcnt < 1 || argcnt > 2)
+         {
+            err << "Must provide argument to put (e.g. put [-r] [-R] <src> [<dest>])"
+                      << std::endl;
+            return false;
+         }
+
+         std::string src = string_util::strip_ws(cmd_to_do.parameters_[0]);
+         std::string dest = src;
+
+         if (argcnt == 2)
+            dest = string_util::strip_ws(cmd_to_do.parameters_[1]);
+
+         if (recursive)
+            sh.scheduler_.rput(conn, src, dest, resume);
+         else if (conn.get_transfer_options().stripes_ > 1 && !resume)
+            sh.striper_.put(conn, src, dest);
+         else
+            compressor.for_put(conn, src).put(src, dest, resume, &out);
+      }
+      break;
+
+      case charon::cmd_type::GET:
+      {
+         bool resume = false;
+         bool recursive = false;
+         while (cmd_to_do.parameters_.size() > 0 &&
+                (cmd_to_do.parameters_[0] == "-r" || cmd_to_do.parameters_[0] == "-R"))
+         {
+            if (cmd_to_do.parameters_[0] == "-r")
+               resume = true;
+            else
+               recursive = true;
+            cmd_to_do.parameters_.erase(cmd_to_do.parameters_.begin());
+         }
+
+         size_t argcnt = cmd_to_do.parameters_.size();
+
+         if (argcnt < 1 || argcnt > 2)
+         {
+            err << "Must provide argument to get (e.g. get [-r] [-R] <src> [<dest>])"
+                      << std::endl;
+            return false;
+         }
+
+         std::string src = string_util::strip_ws(cmd_to_do.parameters_[0]);
+         std::string dest;
+
+         if (argcnt == 2)
+            dest = string_util::strip_ws(cmd_to_do.parameters_[1]);
+
+         if (recursive)
+            sh.scheduler_.rget(conn, src, dest, resume);
+         else if (conn.get_transfer_options().stripes_ > 1 && !resume)
+            sh.striper_.get(conn, src, dest);
+         else
+            compressor.for_get(conn, src).get(src, dest, resume, &out);
+      }
+      break;
+
+      case charon::cmd_type::MPUT:
+      case charon::cmd_type::MGET:
+      {
+         if (cmd_to_do.parameters_.size() < 1)
+         {
+            err << "Must provide argument(s) to mput/mget (e.g. mput *.log data/*.csv)"
+                      << std::endl;
+            return false;
+         }
+
+         if (cmd_to_do.type_ == charon::cmd_type::MPUT)
+            sh.scheduler_.mput(conn, cmd_to_do.parameters_);
+         else
+            sh.scheduler_.mget(conn, cmd_to_do.parameters_);
+      }
+      break;
+
+      case charon::cmd_type::SYNC:
+      {
+         size_t argcnt = cmd_to_do.parameters_.size();
+
+         if (argcnt < 1 || argcnt > 2)
+         {
+            err << "Must provide argument to sync (e.g. sync <src> [<dest>])"
+                      << std::endl;
+            return false;
+         }
+
+         std::string src = string_util::strip_ws(cmd_to_do.parameters_[0]);
+         std::string dest;
+
+         if (argcnt == 2)
+            dest = string_util::strip_ws(cmd_to_do.parameters_[1]);
+
+         charon::delta_sync(conn, out).sync(src, dest);
+      }
+      break;
+
+      case charon::cmd_type::CP:
+      {
+         if (cmd_to_do.parameters_.size() != 2)
+         {
+            err << "Must provide arguments to cp (e.g. cp <src> <dest>)"
+                      << std::endl;
+            return false;
+         }
+
+         conn.copy
+         (
+            string_util::strip_ws(cmd_to_do.parameters_[0]),
+            string_util::strip_ws(cmd_to_do.parameters_[1]),
+            out
+         );
+      }
+      break;
+
+      case charon::cmd_type::MKDIR:
+      case charon::cmd_type::RM:
+      {
+         bool make = (cmd_to_do.type_ == charon::cmd_type::MKDIR);
+         if (cmd_to_do.parameters_.size() != 1)
+         {
+            err << "Must provide argument to " << (make ? "mkdir (e.g. mkdir <dir>)" : "rm (e.g. rm <path>)")
+                << std::endl;
+            return false;
+         }
+
+         std::string path = string_util::strip_ws(cmd_to_do.parameters_[0]);
+         if (make)
+            conn.make_directory(path);
+         else
+            conn.remove(path);
+      }
+      break;
+
+      case charon::cmd_type::STATS:
+         sh.server_.get_monitor().print_stats(out);
+         conn.print_connect_timing(out);
+      break;
+
+      case charon::cmd_type::SET:
+      {
+         charon::transfer_options opts = conn.get_transfer_options();
+
+         if (cmd_to_do.parameters_.size() != 2)
+         {
+            out << "chunk    " << opts.chunk_size_ << std::endl
+                      << "window   " << opts.window_     << std::endl
+                      << "adaptive " << opts.adaptive_   << std::endl
+                      << "stripes  " << opts.stripes_    << std::endl
+                      << "workers  " << opts.workers_    << std::endl
+                      << "io       " << charon::local_io::backend_name(opts.io_backend_)
+                      << std::endl
+                      << "sparse   " << opts.sparse_     << std::endl
+                      << "compress " << charon::compression_router::mode_name(opts.compress_)
+                      << std::endl
+                      << "weight   " << opts.weight_     << std::endl
+                      << "cp       " << (opts.cp_exec_ ? "exec" : "relay") << std::endl
+                      << "rate     " << sh.server_.get_bandwidth().get_rate() << std::endl
+                      << "channels " << sh.server_.get_channels() << std::endl
+                      << "cache    " << sh.server_.get_attribute_cache().get_ttl() << std::endl;
+            return true;
+         }
+
+         std::string name = string_util::to_lower(cmd_to_do.parameters_[0]);
+         if (name == "io")
+         {
+            opts.io_backend_ =
+               charon::local_io::parse_backend(string_util::to_lower(cmd_to_do.parameters_[1]));
+            conn.set_transfer_options(opts);
+            return true;
+         }
+         else if (name == "cp")
+         {
+            std::string mode = string_util::to_lower(cmd_to_do.parameters_[1]);
+            if (mode != "exec" && mode != "relay")
+            {
+               err << "Must provide a cp mode to set (e.g. set cp relay|exec)" << std::endl;
+               return false;
+            }
+            opts.cp_exec_ = (mode == "exec");
+            conn.set_transfer_options(opts);
+            return true;
+         }
+         else if (name == "compress")
+         {
+            opts.compress_ =
+               charon::compression_router::parse_mode(string_util::to_lower(cmd_to_do.parameters_[1]));
+            conn.set_transfer_options(opts);
+            return true;
+         }
+
+         size_t value = string_util::string_to_numeric<size_t>(cmd_to_do.parameters_[1]);
+
+         // Global cap in bytes/second across all transfers; 0 lifts it.
+         if (name == "rate")
+         {
+            sh.server_.get_bandwidth().set_rate(value);
+            return true;
+         }
+         else if (name == "channels" && value > 0)
+         {
+            sh.server_.set_channels(value);
+            return true;
+         }
+         // Seconds remote attributes are trusted for; 0 turns caching off.
+         else if (name == "cache")
+         {
+            sh.server_.get_attribute_cache().set_ttl(static_cast<int>(value));
+            return true;
+         }
+
+         if (name == "adaptive")
+            opts.adaptive_ = (value != 0);
+         else if (name == "sparse")
+            opts.sparse_ = (value != 0);
+         else if (name == "chunk" && value > 0)
+            opts.chunk_size_ = value;
+         else if (name == "window" && value > 0)
+            opts.window_ = value;
+         else if (name == "stripes" && value > 0)
+            opts.stripes_ = value;
+         else if (name == "workers" && value > 0)
+            opts.workers_ = value;
+         else if (name == "weight" && value > 0)
+            opts.weight_ = value;
+         else
+         {
+            err << "Must provide a known option and positive value to set "
+                      << "(e.g. set window 64)"
+                      << std::endl;
+            return false;
+         }
+
+         conn.set_transfer_options(opts);
+      }
+      break;
+
+      case charon::cmd_type::ERROR:
+      default:
+         err << "Unspecified error parsing SFTP command. "
+                   << "Please try again."
+                   << std::endl;
+         return false;
+   }
+
+   return true;
+}
+
+}
+
 int main(int argc, char ** argv)
 {
    try
@@ -47,6 +398,98 @@ int main(int argc, char ** argv)
             host = endpoint.substr(at);
          }
 
+         // Hand the commands to the endpoint's control daemon, forking one
+         // first (before any threads or sessions exist) if none is up.
+         if (ap.control())
+         {
+            std::string path = charon::control_master::socket_path(user, host, port);
+
+            int fd = charon::control_master::connect_client(path);
+            if (fd < 0)
+            {
+               fd = charon::control_master::spawn
+               (
+                  path,
+                  [&user, &host, port, &path]() -> int
+                  {
+                     charon::sftp_server server(host, port);
+                     server.set_idle_timeout(charon::control_master::IDLE_TIMEOUT_SECS);
+
+                     charon::sftp_conn_ptr conn = server.connect(user);
+                     if (!conn)
+                        return 8;
+                     server.checkin(conn);
+                     conn.reset();
+
+                     charon::control_master master
+                     (
+                        server,
+                        user,
+                        [&server, &user](charon::sftp_connection & c, charon::compression_router & r,
+                                         charon::cmd_data & cmd, std::ostream & out, std::ostream & err)
+                        {
+                           // Per command, as clients run side by side.
+                           charon::striped_transfer striper(server, user);
+                           charon::transfer_scheduler scheduler(server, user);
+                           shell sh = {server, striper, scheduler};
+                           return run_command(sh, c, r, cmd, out, err);
+                        }
+                     );
+                     master.serve(path);
+                     return 0;
+                  }
+               );
+            }
+
+            if (fd < 0)
+            {
+               std::cerr << "Unable to start charon control daemon." << std::endl;
+               exit(8);
+            }
+
+            size_t failed = 0;
+            if (!ap.batch_file().empty())
+            {
+               std::ifstream in(ap.batch_file().c_str());
+               if (!in)
+               {
+                  std::cerr << "Unable to open batch file '" << ap.batch_file() << "'" << std::endl;
+                  exit(16);
+               }
+               failed = charon::control_master::run_client(fd, in, false);
+            }
+            else
+               failed = charon::control_master::run_client(fd, std::cin, ::isatty(STDIN_FILENO) != 0);
+
+            return (failed > 0) ? 4 : 0;
+         }
+
+         // A script, given with -b or piped in, is parsed whole before
+         // connecting so a typo fails the run rather than half of it.
+         charon::cmd_parser cp;
+         std::vector<charon::cmd_data> script;
+         bool batch = !ap.batch_file().empty() || !::isatty(STDIN_FILENO);
+
+         if (batch)
+         {
+            bool parsed = false;
+            if (!ap.batch_file().empty())
+            {
+               std::ifstream in(ap.batch_file().c_str());
+               if (!in)
+               {
+                  std::cerr << "Unable to open batch file '" << ap.batch_file() << "'" << std::endl;
+                  exit(16);
+               }
+               parsed = cp.read_script(in, script);
+            }
+            else
+               parsed = cp.read_script(std::cin, script);
+
+            if (!parsed)
+               exit(16);
+         }
+
          charon::sftp_server server(host, port);
 
          charon::sftp_conn_ptr conn = server.connect(user);
@@ -57,7 +500,36 @@ int main(int argc, char ** argv)
          }
          std::cout << "*--Successfully connected to remote SFTP host." << std::endl;
 
-         charon::cmd_parser cp;
+         charon::striped_transfer striper(server, user);
+         charon::transfer_scheduler scheduler(server, user);
+         charon::compression_router compressor(server, user);
+
+         shell sh = {server, striper, scheduler};
+
+         if (batch)
+         {
+            charon::batch_runner runner
+            (
+               server,
+               user,
+               *conn,
+               compressor,
+               [&sh](charon::sftp_connection & c, charon::compression_router & r,
+                     charon::cmd_data & cmd, std::ostream & out, std::ostream & err)
+               {
+                  return run_command(sh, c, r, cmd, out, err);
+               }
+            );
+
+            size_t failed = runner.run(script);
+            if (failed > 0)
+            {
+               std::cerr << failed << " command(s) failed." << std::endl;
+               exit(4);
+            }
+            return 0;
+         }
+
          for
          (
             charon::cmd_data cmd_to_do = cp.get_next_cmd();
@@ -67,87 +539,7 @@ int main(int argc, char ** argv)
          {
             try
             {
-               switch (cmd_to_do.type_)
-               {
-                  case charon::cmd_type::HELP:
-                     std::cout << "Help is coming..." << std::endl;
-                  break;
-
-                  case charon::cmd_type::LIST:
-                  {
-                     std::string path;
-                     if (cmd_to_do.parameters_.size() > 0)
-                        path = string_util::strip_ws(cmd_to_do.parameters_[0]);
-                     else
-                        path = "./";         // default to current directory
-
-                     charon::sftp_directory dir = conn->read_directory(path);
-                     std::cout << dir;
-                  }
-                  break;
-
-                  case charon::PWD:
-                     conn->print_working_directory();
-                  break;
-
-                  case charon::CD:
-                  {
-                     std::string path;
-                     if (cmd_to_do.parameters_.size() > 0)
-                        path = string_util::strip_ws(cmd_to_do.parameters_[0]);
-                     else
-                        path = "./";         // default to current directory
-
-                     conn->change_directory(path);
-                     std::cout << "Changed directory to " << path << std::endl;
-                  }
-                  break;
-
-                  case charon::STAT:
-                  {
-                     std::string path;
-                     if (cmd_to_do.parameters_.size() > 0)
-                        path = string_util::strip_ws(cmd_to_do.parameters_[0]);
-                     else
-                     {
-                        std::cerr << "Must provide argument to stat (e.g. stat <foo>)"
-                                  << std::endl;
-                        continue;
-                     }
-
-                     charon::sftp_file f = conn->stat(path);
-                     f.print_stat();
-                  }
-                  break;
-
-                  case charon::cmd_type::PUT:
-                  {
-                     size_t argcnt = cmd_to_do.parameters_.size();
-
-                     if (argcnt < 1 || argcnt > 2)
-                     {
-                        std::cerr << "Must provide argument to put (e.g. put <src> [<dest>])"
-                                  << std::endl;
-                        continue;
-                     }
-
-                     std::string src = string_util::strip_ws(cmd_to_do.parameters_[0]);
-                     std::string dest = src;
-
-                     if (argcnt == 2)
-                        dest = string_util::strip_ws(cmd_to_do.parameters_[1]);
-
-                     conn->put(src, dest);
-                  }
-                  break;
-
-                  case charon::cmd_type::ERROR:
-                  default:
-                     std::cerr << "Unspecified error parsing SFTP command. "
-                               << "Please try again."
-                               << std::endl;
-                  break;
-               }
+               run_command(sh, *conn, compressor, cmd_to_do, std::cout, std::cerr);
             }
             catch (const std::exception & err)
             {
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstring>
+
+#include "prefetch_reader.h"
+
+namespace charon {
+
+prefetch_reader::prefetch_reader(io_ptr && inner)
+   : local_io(inner->fd(), inner->path()),
+     inner_(std::move(inner)),
+     next_(0),
+     generation_(0),
+     eof_(false),
+     error_(false),
+     stop_(false),
+     worker_(&prefetch_reader::work_routine, this)
+{
+}
+
+prefetch_reader::~prefetch_reader()
+{
+   this->close();
+}
+
+void prefetch_reader::work_routine()
+{
+   std::unique_lock<std::mutex> lock(this->lock_);
+
+   for (;;)
+   {
+      this->cv_.wait
+      (
+         lock,
+         [this]
+         {
+            return this->stop_ ||
+                   (!this->eof_ && !this->error_ && this->ready_.size() < DEPTH);
+         }
+      );
+
+      if (this->stop_)
+         return;
+
+      uint64_t offset = this->next_;
+      uint64_t generation = this->generation_;
+
+      lock.unlock();
+
+      std::shared_ptr<char> data(new char[BLOCK_SIZE], std::default_delete<char[]>());
+      ssize_t rc = this->inner_->read(data.get(), BLOCK_SIZE, offset);
+
+      lock.lock();
+
+      // Discard blocks read for a span the consumer has since left.
+      if (generation != this->generation_)
+         continue;
+
+      if (rc < 0)
+         this->error_ = true;
+      else
+      {
+         if (rc > 0)
+            this->ready_.push_back({offset, static_cast<size_t>(rc), data});
+
+         this->next_ += rc;
+         if (static_cast<size_t>(rc) < BLOCK_SIZE)
+            this->eof_ = true;
+      }
+
+      this->cv_.notify_all();
+   }
+}
+
+void prefetch_reader::restart(uint64_t offset)
+{
+   this->ready_.clear();
+   this->next_ = offset;
+   this->eof_ = false;
+   this->error_ = false;
+   ++this->generation_;
+   this->cv_.notify_all();
+}
+
+ssize_t prefetch_reader::read(char * buf, size_t len, uint64_t offset)
+{
+   std::unique_lock<std::mutex> lock(this->lock_);
+
+   size_t copied = 0;
+   while (copied < len)
+   {
+      uint64_t pos = offset + copied;
+
+      // Drop blocks the consumer has moved past.
+      while (!this->ready_.empty() &&
+             this->ready_.front().offset_ + this->ready_.front().length_ <= pos)
+      {
+         this->ready_.pop_front();
+         this->cv_.notify_all();
+      }
+
+      uint64_t span_start = this->ready_.empty() ? this->next_ : this->ready_.front().offset_;
+      if (pos < span_start || pos > this->next_)
+         this->restart(pos);
+
+      this->cv_.wait
+      (
+         lock,
+         [this] {return !this->ready_.empty() || this->eof_ || this->error_;}
+      );
+
+      if (this->ready_.empty())
+      {
+         if (this->error_)
+            return -1;
+         break;      // EOF
+      }
+
+      const block & b = this->ready_.front();
+      if (pos < b.offset_)
+         continue;    // restarted underneath us; go around again
+
+      size_t skip = static_cast<size_t>(pos - b.offset_);
+      size_t cnt = std::min(len - copied, b.length_ - skip);
+      memcpy(buf + copied, b.data_.get() + skip, cnt);
+      copied += cnt;
+   }
+
+   return static_cast<ssize_t>(copied);
+}
+
+ssize_t prefetch_reader::write(const char * buf, size_t len, uint64_t offset)
+{
+   return this->inner_->write(buf, len, offset);
+}
+
+bool prefetch_reader::close()
+{
+   {
+      std::lock_guard<std::mutex> guard(this->lock_);
+      this->stop_ = true;
+      this->cv_.notify_all();
+   }
+
+   if (this->worker_.joinable())
+      this->worker_.join();
+
+   // The descriptor belongs to inner_.
+   this->fd_ = -1;
+   return this->inner_->close();
+}
+
+}
@@ -0,0 +1,56 @@
+#ifndef PREFETCH_READER_H
+#define PREFETCH_READER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "local_io.h"
+
+namespace charon {
+
+   // Reads ahead of an upload on a thread of its own, so the next blocks
+   // are already in memory by the time the network side asks for them.
+   // A read outside the prefetched span restarts read-ahead from there.
+   class prefetch_reader : public local_io
+   {
+      private :
+         static const size_t BLOCK_SIZE = 1 << 20;
+         static const size_t DEPTH      = 8;
+
+         struct block
+         {
+            uint64_t                offset_;
+            size_t                  length_;
+            std::shared_ptr<char>   data_;
+         };
+
+         io_ptr                  inner_;
+
+         std::mutex              lock_;
+         std::condition_variable cv_;
+         std::deque<block>       ready_;
+         uint64_t                next_;          // next offset to prefetch
+         uint64_t                generation_;    // bumped on every restart
+         bool                    eof_;
+         bool                    error_;
+         bool                    stop_;
+
+         std::thread             worker_;
+
+         void work_routine();
+         void restart(uint64_t offset);
+
+      public :
+
+         explicit prefetch_reader(io_ptr && inner);
+         ~prefetch_reader();
+
+         ssize_t read(char * buf, size_t len, uint64_t offset);
+         ssize_t write(const char * buf, size_t len, uint64_t offset);
+         bool    close();
+   };
+}
+
+#endif // PREFETCH_READER_H
@@ -1,20 +1,79 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <errno.h>
 #include <exception>
 #include <iostream>
 #include <memory>
 #include <fcntl.h>
-#include <fstream>
+#include <iomanip>
 #include <sstream>
 #include <sys/stat.h>
 #include <string.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
 
 #include <libssh/sftp.h>
 #include <libssh/libsshpp.hpp>
 
+#include "cipher_selector.h"
+#include "directory_stream.h"
+#include "known_hosts_index.h"
+#include "local_state.h"
 #include "sftp_connection.h"
+#include "transfer_journal.h"
+#include "window_controller.h"
 
 namespace charon {
 
-bool sftp_connection::authenticate_server()
+namespace {
+
+double seconds_between(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+   return std::chrono::duration<double>(to - from).count();
+}
+
+// The user known_hosts file libssh checks, once ssh_connect() has filled
+// in its default.
+std::string known_hosts_file(::ssh_session session)
+{
+   char * path = nullptr;
+   if (ssh_options_get(session, SSH_OPTIONS_KNOWNHOSTS, &path) == SSH_OK && path != nullptr)
+   {
+      std::string file(path);
+      ssh_string_free_char(path);
+      return file;
+   }
+
+   const char * home = ::getenv("HOME");
+   return std::string((home != nullptr) ? home : "") + "/.ssh/known_hosts";
+}
+
+// Held across questions put to the terminal, so sessions connecting from
+// several threads ask one at a time.
+std::mutex & prompt_lock()
+{
+   static std::mutex lock;
+   return lock;
+}
+
+}
+
+void sftp_connection::ssh_link::on_status(void * userdata, float status)
+{
+   // libssh reports 0.2 once it has started the socket connect and more
+   // as soon as the server's banner is in.
+   ssh_link * link = static_cast<ssh_link *>(userdata);
+   if (status > 0.2f && !link->banner_seen_)
+   {
+      link->banner_ = std::chrono::steady_clock::now();
+      link->banner_seen_ = true;
+   }
+}
+
+bool sftp_connection::authenticate_server(const std::string & host, short port)
 {
    int rc, state;
    size_t hlen;
@@ -25,12 +84,54 @@ bool sftp_connection::authenticate_server()
 
    ssh_key server_key;
 
-   state = ssh_is_server_known(this->ssh_sess_);
-
    rc = ssh_get_publickey(this->ssh_sess_, &server_key);
    if (rc != SSH_OK)
       throw ssh::SshException(this->ssh_sess_);
 
+   rc = ssh_get_publickey_hash(server_key, SSH_PUBLICKEY_HASH_SHA256, &hash, &hlen);
+   if (rc != SSH_OK)
+   {
+      ssh_key_free(server_key);
+      throw ssh::SshException(this->ssh_sess_);
+   }
+
+   unsigned char digest[known_hosts_index::DIGEST_SIZE];
+   bool indexable = (hlen == sizeof(digest));
+   if (indexable)
+      memcpy(digest, hash, sizeof(digest));
+   ssh_clean_pubkey_hash(&hash);
+
+   // The index follows known_hosts itself, so removed and revoked keys
+   // stop matching; libssh's own scan only feeds it.
+   std::string name = known_hosts_index::host_name(host, port);
+   std::unique_ptr<known_hosts_index> index;
+   if (indexable)
+   {
+      try
+      {
+         index.reset(new known_hosts_index(known_hosts_file(this->ssh_sess_)));
+      }
+      catch (const std::exception & e)
+      {
+         std::cerr << "Not using known_hosts index: " << e.what() << std::endl;
+      }
+   }
+
+   if (index && index->revoked(digest))
+   {
+      ssh_key_free(server_key);
+      std::cerr << "The host key for this server has been revoked." << std::endl;
+      return false;
+   }
+
+   if (index && index->contains(name, digest))
+   {
+      ssh_key_free(server_key);
+      return true;
+   }
+
+   state = ssh_is_server_known(this->ssh_sess_);
+
    rc = ssh_get_publickey_hash(server_key, SSH_PUBLICKEY_HASH_MD5, &hash, &hlen);
    if (rc != SSH_OK)
       throw ssh::SshException(this->ssh_sess_);
@@ -40,6 +141,8 @@ bool sftp_connection::authenticate_server()
    switch (state)
    {
       case SSH_SERVER_KNOWN_OK:
+         if (index)
+            index->learn(name, digest);
       break;
 
       case SSH_SERVER_KNOWN_CHANGED:
@@ -70,6 +173,7 @@ bool sftp_connection::authenticate_server()
 
       case SSH_SERVER_NOT_KNOWN:
       {
+         std::lock_guard<std::mutex> prompting(prompt_lock());
          std::unique_ptr<char> hexa(ssh_get_hexa(hash, hlen));
 
          std::cerr << "The server is unknown. Do you trust the host key?"
@@ -93,7 +197,11 @@ bool sftp_connection::authenticate_server()
             auth_ok = false;
             break;
          }
+
+         if (index)
+            index->learn(name, digest);
       }
+      break;
 
       case SSH_SERVER_ERROR:
          std:: cerr << "Error " << ssh_get_error(this->ssh_sess_) << std::endl;
@@ -106,10 +214,27 @@ bool sftp_connection::authenticate_server()
 
 }
 
-bool sftp_connection::authenticate_user(const std::string & user)
+bool sftp_connection::authenticate_user(const std::string & user, connect_cache & cache)
 {
    int rc;
 
+   // Straight to the key which worked last time, skipping the none and
+   // list round trips; anything short of success starts over below.
+   if (cache.auth_method() == "publickey")
+   {
+      rc = ssh_userauth_publickey_auto(this->ssh_sess_, user.c_str(), nullptr);
+      if (rc == SSH_AUTH_ERROR)
+      {
+         std::cerr << "Authentication failed: " <<   ssh_get_error(this->ssh_sess_)
+                   << std::endl;
+         throw ssh::SshException(this->ssh_sess_);
+      }
+      else if (rc == SSH_AUTH_SUCCESS)
+      {
+         return true;
+      }
+   }
+
    // First try anonymous access (auth = 'none')
    rc = ssh_userauth_none(this->ssh_sess_, user.c_str());
    if (rc == SSH_AUTH_ERROR)
@@ -120,6 +245,7 @@ bool sftp_connection::authenticate_user(const std::string & user)
    }
    else if (rc == SSH_AUTH_SUCCESS)
    {
+      cache.set_auth_method("none");
       return true;
    }
    else
@@ -153,13 +279,18 @@ bool sftp_connection::authenticate_user(const std::string & user)
          else if (rc == SSH_AUTH_SUCCESS)
          {
             std::cout << "*--Successfully authenticated user via public key." << std::endl;
+            cache.set_auth_method("publickey");
             return true;
          }
       }
 
       if (method & SSH_AUTH_METHOD_PASSWORD)
       {
-         std::unique_ptr<char> password(getpass("Enter your password: "));
+         std::unique_ptr<char> password;
+         {
+            std::lock_guard<std::mutex> prompting(prompt_lock());
+            password.reset(getpass("Enter your password: "));
+         }
          // TO DO - get rid of password(), use custom password echo function
          rc = ssh_userauth_password(this->ssh_sess_, user.c_str(), password.get());
          if (rc == SSH_AUTH_ERROR)
@@ -185,6 +316,7 @@ bool sftp_connection::authenticate_user(const std::string & user)
          else if (rc == SSH_AUTH_SUCCESS)
          {
             std::cout << "*--Successfully authenticated user via password." << std::endl;
+            cache.set_auth_method("");
             return true;
          }
       }
@@ -204,23 +336,56 @@ bool sftp_connection::authenticate_user(const std::string & user)
 }
 
 
-sftp_connection::sftp_connection(const std::string & user, const std::string & host, short port)
-   : ssh_sess_(ssh_new())
+sftp_connection::sftp_connection
+(
+   const std::string & user,
+   const std::string & host,
+   short port,
+   bool compress,
+   bandwidth_scheduler * bandwidth,
+   transfer_monitor * monitor,
+   attribute_cache * attr_cache
+)
+   : link_(std::make_shared<ssh_link>(ssh_new())),
+     ssh_sess_(link_->sess_),
+     sftp_sess_(nullptr),
+     user_(user),
+     compressed_(compress),
+     bandwidth_(bandwidth),
+     monitor_(monitor),
+     attr_cache_(attr_cache),
+     timing_()
 {
    if (ssh_options_set(this->ssh_sess_, SSH_OPTIONS_HOST, host.c_str()) != SSH_OK)
    {
-      ssh_free(this->ssh_sess_);
       throw std::logic_error("Encountered error assigning sftp_server host.");
    }
 
    long lport = port;
    if (ssh_options_set(this->ssh_sess_, SSH_OPTIONS_PORT,  &lport) != SSH_OK)
    {
-      ssh_free(this->ssh_sess_);
       throw std::logic_error("Encountered error assigning sftp_server port.");
    }
 
+   // Fastest ciphers first, measured once per host
+   cipher_selector ciphers(host, port);
+   if (!ciphers.apply(this->ssh_sess_))
+      std::cerr << "Couldn't apply measured cipher preferences; using libssh defaults." << std::endl;
+
+   // Offer zlib both ways when asked, still accepting a server without it.
+   const char * compression = compress ? "zlib@openssh.com,zlib,none" : "none";
+   if (ssh_options_set(this->ssh_sess_, SSH_OPTIONS_COMPRESSION, compression) != SSH_OK)
+   {
+      throw std::logic_error("Encountered error assigning sftp_server compression.");
+   }
+
+   this->link_->callbacks_.userdata = this->link_.get();
+   this->link_->callbacks_.connect_status_function = &ssh_link::on_status;
+   ssh_callbacks_init(&this->link_->callbacks_);
+   ssh_set_callbacks(this->ssh_sess_, &this->link_->callbacks_);
+
    // Build the connection
+   auto start = std::chrono::steady_clock::now();
    int rc = ssh_connect(this->ssh_sess_);
    if (rc != SSH_OK)
    {
@@ -230,44 +395,142 @@ sftp_connection::sftp_connection(const std::string & user, const std::string & h
       throw ssh::SshException(this->ssh_sess_);
    }
 
-   sftp_conn_ptr conn;
+   auto connected = std::chrono::steady_clock::now();
+   auto banner = this->link_->banner_seen_ ? this->link_->banner_ : connected;
+   this->timing_.tcp_ = seconds_between(start, banner);
+   this->timing_.kex_ = seconds_between(banner, connected);
+
+   connect_cache cache(user, host, port);
+
    // Authenticate the server
-   if (!this->authenticate_server())
+   if (!this->authenticate_server(host, port))
       throw std::logic_error("Unable to authenticate server.");
 
+   auto verified = std::chrono::steady_clock::now();
+   this->timing_.hostkey_ = seconds_between(connected, verified);
+
    // Authenticate the user
-   if (!this->authenticate_user(user))
+   if (!this->authenticate_user(user, cache))
       throw std::logic_error("Unable to authenticate user.");
 
+   this->timing_.auth_ = seconds_between(verified, std::chrono::steady_clock::now());
+   cache.save();
+
+   this->open_channel();
+   ++this->link_->channels_;
+}
+
+sftp_connection::sftp_connection
+(
+   const link_ptr & link,
+   const std::string & user,
+   bool compress,
+   bandwidth_scheduler * bandwidth,
+   transfer_monitor * monitor,
+   attribute_cache * attr_cache
+)
+   : link_(link),
+     ssh_sess_(link->sess_),
+     sftp_sess_(nullptr),
+     user_(user),
+     compressed_(compress),
+     bandwidth_(bandwidth),
+     monitor_(monitor),
+     attr_cache_(attr_cache),
+     timing_()
+{
+   this->open_channel();
+}
+
+void sftp_connection::open_channel()
+{
+   session_guard guard(this->link_->lock_);
+
+   // NULL when the server won't open another channel (e.g. sshd's
+   // MaxSessions), as well as when out of memory.
    std::unique_ptr<sftp_session_struct> tmp(sftp_new(this->ssh_sess_));
    if (tmp == nullptr)
-      throw std::bad_alloc();
+      throw std::runtime_error(std::string("Couldn't open an SFTP channel: ") + ssh_get_error(this->ssh_sess_));
 
-   rc = sftp_init(tmp.get());
+   auto start = std::chrono::steady_clock::now();
+   int rc = sftp_init(tmp.get());
+   auto ready = std::chrono::steady_clock::now();
+   this->timing_.sftp_init_ = seconds_between(start, ready);
    if (rc == SSH_OK)
    {
       char * workingDir = sftp_canonicalize_path(tmp.get(), "./");
+      this->timing_.canonicalize_ = seconds_between(ready, std::chrono::steady_clock::now());
       if (workingDir == nullptr)
          throw std::runtime_error("Failed to initialize SFTP working directory.");
       this->cwd_ = workingDir;
+      this->home_ = this->cwd_;
 
       this->sftp_sess_ = tmp.release();
    }
    else
       throw std::runtime_error("Failed to initialize sftp_connection.");
+
+   this->query_limits();
+}
+
+bool sftp_connection::is_alive(bool round_trip)
+{
+   session_guard guard(this->link_->lock_);
+
+   if (ssh_is_connected(this->ssh_sess_) == 0)
+      return false;
+
+   if (!round_trip)
+      return true;
+
+   sftp_attributes attrib = sftp_stat(this->sftp_sess_, this->home_.c_str());
+   if (attrib == nullptr)
+      return false;
+
+   sftp_attributes_free(attrib);
+   return true;
+}
+
+void sftp_connection::query_limits()
+{
+   // Lengths every SFTP server must accept (draft-ietf-secsh-filexfer-02),
+   // used when the server doesn't say; a 0 in its reply means the same.
+   this->limits_.max_read_  = 32768;
+   this->limits_.max_write_ = 32768;
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,11,0)
+   if (sftp_extension_supported(this->sftp_sess_, "limits@openssh.com", "1"))
+   {
+      sftp_limits_t limits = sftp_limits(this->sftp_sess_);
+      if (limits != nullptr)
+      {
+         if (limits->max_read_length > 0)
+            this->limits_.max_read_ = limits->max_read_length;
+         if (limits->max_write_length > 0)
+            this->limits_.max_write_ = limits->max_write_length;
+         sftp_limits_free(limits);
+      }
+   }
+#endif
 }
 
 sftp_connection::~sftp_connection()
 {
+   // The SSH session itself goes with the last channel on its link.
+   session_guard guard(this->link_->lock_);
    sftp_free(this->sftp_sess_);
    this->sftp_sess_ = nullptr;
-
-   ssh_free(this->ssh_sess_);
-   this->ssh_sess_ = nullptr;
+   --this->link_->channels_;
 }
 
 std::string sftp_connection::canonicalize(const std::string & path)
 {
+   std::string cached;
+   if (this->attr_cache_ != nullptr && this->attr_cache_->lookup_path(this->user_, path, cached))
+      return cached;
+
+   session_guard guard(this->link_->lock_);
+
    char * canonicalPath = sftp_canonicalize_path(this->sftp_sess_, path.c_str());
    if (!canonicalPath)
    {
@@ -276,7 +539,12 @@ std::string sftp_connection::canonicalize(const std::string & path)
       throw std::logic_error(err);
    }
 
-   return std::string(canonicalPath);
+   std::string result(canonicalPath);
+   ssh_string_free_char(canonicalPath);
+
+   if (this->attr_cache_ != nullptr)
+      this->attr_cache_->store_path(this->user_, path, result);
+   return result;
 }
 
 void sftp_connection::change_directory(const std::string & dir)
@@ -284,13 +552,17 @@ void sftp_connection::change_directory(const std::string & dir)
    if (dir.length() < 1)
       return;
 
-   std::string newPath;
-   if (dir[0] == '/')
-      newPath = dir;
-   else
-      newPath = this->cwd_ + "/" + dir;
+   std::string newPath = this->resolve_path(dir);
+
+   // Only ask the server for a realpath when a symlink may be involved.
+   std::string canonicalPath = newPath;
+   if (!this->known_canonical(newPath))
+   {
+      bool resolved = (newPath + "/").find("/../") == std::string::npos;
+      if (!resolved || !this->known_canonical(dir_name(newPath)) || !this->plain_directory(newPath))
+         canonicalPath = this->canonicalize(newPath);
+   }
 
-   std::string canonicalPath = this->canonicalize(newPath);
    sftp_file obj = this->stat(canonicalPath);
    if (!obj.is_directory())
    {
@@ -303,94 +575,1379 @@ void sftp_connection::change_directory(const std::string & dir)
    this->cwd_ = canonicalPath;
 }
 
+std::string sftp_connection::resolve_path(const std::string & path) const
+{
+   std::string full = ((path.length() > 0) && (path[0] == '/')) ? path : this->cwd_ + "/" + path;
+
+   std::string out;        // empty for the root
+   size_t pos = 0;
+   while (pos < full.length())
+   {
+      size_t next = full.find('/', pos);
+      if (next == std::string::npos)
+         next = full.length();
+
+      std::string seg = full.substr(pos, next - pos);
+      if (seg == "..")
+      {
+         // Through a symlink ".." leads somewhere else entirely.
+         if (!out.empty() && !this->known_canonical(out))
+            return out + "/" + full.substr(pos);
+
+         out.erase(std::min(out.length(), out.find_last_of('/')));
+      }
+      else if (!seg.empty() && seg != ".")
+         out += "/" + seg;
+
+      pos = next + 1;
+   }
+
+   return out.empty() ? std::string("/") : out;
+}
+
+bool sftp_connection::known_canonical(const std::string & path) const
+{
+   auto leads_to = [&path](const std::string & canonical)
+   {
+      return canonical.compare(0, path.length(), path) == 0 &&
+             (canonical.length() == path.length() || canonical[path.length()] == '/' || path == "/");
+   };
+
+   if (leads_to(this->cwd_) || leads_to(this->home_))
+      return true;
+
+   std::string canonical;
+   return this->attr_cache_ != nullptr &&
+          this->attr_cache_->lookup_path(this->user_, path, canonical) &&
+          canonical == path;
+}
+
+bool sftp_connection::plain_directory(const std::string & path)
+{
+   session_guard guard(this->link_->lock_);
+
+   sftp_attributes attrib = sftp_lstat(this->sftp_sess_, path.c_str());
+   if (attrib == nullptr)
+      return false;
+
+   if (attrib->type != SSH_FILEXFER_TYPE_DIRECTORY)
+   {
+      sftp_attributes_free(attrib);
+      return false;
+   }
+
+   // Not a symlink, so what LSTAT saw is what STAT would.
+   if (this->attr_cache_ != nullptr)
+   {
+      sftp_file file(std::move(attrib));
+      this->attr_cache_->store(this->user_, path, file);
+      this->attr_cache_->store_path(this->user_, path, path);
+   }
+   else
+      sftp_attributes_free(attrib);
+
+   return true;
+}
+
 void sftp_connection::print_working_directory() const
 {
    std::cout << "Current working directory is " << this->cwd_ << std::endl;
 }
 
+void sftp_connection::print_connect_timing(std::ostream & out) const
+{
+   const connect_timing & t = this->timing_;
+   double total = t.tcp_ + t.kex_ + t.hostkey_ + t.auth_ + t.sftp_init_ + t.canonicalize_;
+
+   std::ios::fmtflags flags = out.flags();
+   std::streamsize precision = out.precision();
+   out << std::fixed << std::setprecision(1)
+       << "connect  tcp "        << t.tcp_ * 1000          << "ms"
+       << ", kex "               << t.kex_ * 1000          << "ms"
+       << ", hostkey "           << t.hostkey_ * 1000      << "ms"
+       << ", auth "              << t.auth_ * 1000         << "ms"
+       << ", sftp_init "         << t.sftp_init_ * 1000    << "ms"
+       << ", canonicalize "      << t.canonicalize_ * 1000 << "ms"
+       << " (" << total * 1000 << "ms)" << std::endl;
+   out.flags(flags);
+   out.precision(precision);
+}
+
 sftp_directory sftp_connection::read_directory(const std::string & path)
 {
-   std::string realPath;
-   // TO DO : need path validation logic
-   if ((path.length() > 0) && (path[0] != '/'))
-      realPath = this->cwd_ + "/" + path;
-   else
-      realPath = path;
+   std::string realPath = this->resolve_path(path);
+
+   session_guard guard(this->link_->lock_);
+   sftp_directory dir(this->sftp_sess_, realPath);
+
+   // Interactive traffic skips the bandwidth queue; account for it after.
+   if (this->bandwidth_ != nullptr)
+   {
+      size_t bytes = 0;
+      for (auto it = dir.begin(); it != dir.end(); ++it)
+         bytes += (*it)->get_name().length() + (*it)->get_long_name().length() + ATTRS_WIRE_SIZE;
+      this->bandwidth_->charge(bytes);
+   }
+
+   return dir;
+}
+
+size_t sftp_connection::list_directory(const std::string & path, const entry_fn & on_entry)
+{
+   directory_stream stream(this->sftp_sess_, this->link_->lock_, this->resolve_path(path));
+
+   size_t count = 0;
+   sftp_file_ptr entry;
+   while (stream.next(entry))
+   {
+      if (this->bandwidth_ != nullptr)
+         this->bandwidth_->charge(entry->get_name().length() + entry->get_long_name().length() + ATTRS_WIRE_SIZE);
+
+      on_entry(entry);
+      ++count;
+   }
 
-   return sftp_directory(this->sftp_sess_, realPath);
+   return count;
 }
 
-sftp_file sftp_connection::stat(const std::string & path)
+sftp_file sftp_connection::stat(const std::string & rpath)
 {
+   std::string path = this->resolve_path(rpath);
+   std::string err = "Couldn't stat object at '" + rpath + "'";
+
+   if (this->attr_cache_ != nullptr)
+   {
+      sftp_file cached;
+      switch (this->attr_cache_->lookup(this->user_, path, cached))
+      {
+         case attribute_cache::PRESENT:
+            return cached;
+         case attribute_cache::ABSENT:
+            throw std::logic_error(err);
+         default:
+         break;
+      }
+   }
+
+   session_guard guard(this->link_->lock_);
+
    sftp_attributes attrib;
 
    attrib = sftp_stat(this->sftp_sess_, path.c_str());
    if (!attrib)
    {
-      std::string err = "Couldn't stat object at '";
-      err +=  path + "'";
+      if (this->attr_cache_ != nullptr && sftp_get_error(this->sftp_sess_) == SSH_FX_NO_SUCH_FILE)
+         this->attr_cache_->store_absent(this->user_, path);
       throw std::logic_error(err);
    }
 
    if ((attrib->name == nullptr) || (strlen(attrib->name) < 1))
-      attrib->name = const_cast<char*>(path.c_str());
+   {
+      free(attrib->name);
+      attrib->name = strdup(rpath.c_str());
+   }
+
+   if (this->bandwidth_ != nullptr)
+      this->bandwidth_->charge(path.length() + ATTRS_WIRE_SIZE);
+
+   sftp_file file(std::move(attrib));
+   if (this->attr_cache_ != nullptr)
+      this->attr_cache_->store(this->user_, path, file);
+   return file;
+}
+
+sftp_connection::tracking::tracking
+(
+   sftp_connection & conn,
+   const std::string & label,
+   char direction,
+   uint64_t total
+)
+   : conn_(conn),
+     owner_(!conn.metrics_)
+{
+   if (!this->owner_)
+      return;
+
+   if (conn.monitor_ != nullptr)
+      conn.metrics_ = conn.monitor_->begin(label, direction, total);
+   else
+      conn.metrics_.reset(new transfer_metrics(label, direction, total));
+}
+
+sftp_connection::tracking::~tracking()
+{
+   if (!this->owner_)
+      return;
+
+   // Through the monitor, so the progress line is finished before the
+   // command's own output follows it.
+   if (this->conn_.monitor_ != nullptr)
+      this->conn_.monitor_->end(this->conn_.metrics_, std::uncaught_exception());
+   else
+      this->conn_.metrics_->finish(std::uncaught_exception());
+   this->conn_.metrics_.reset();
+}
+
+sftp_connection::invalidating::invalidating(sftp_connection & conn, const std::string & path, bool tree)
+   : conn_(conn),
+     path_(path),
+     tree_(tree)
+{
+   this->forget();
+}
+
+sftp_connection::invalidating::~invalidating()
+{
+   this->forget();
+}
+
+void sftp_connection::invalidating::forget()
+{
+   if (this->conn_.attr_cache_ == nullptr)
+      return;
+
+   if (this->tree_)
+      this->conn_.attr_cache_->invalidate_tree(this->path_);
+   else
+      this->conn_.attr_cache_->invalidate(this->path_);
+}
+
+size_t sftp_connection::peek(const std::string & rpath, char * buf, size_t len)
+{
+   std::string src = this->resolve_path(rpath);
+
+   session_guard guard(this->link_->lock_);
+
+   ::sftp_file remote_file = sftp_open(this->sftp_sess_, src.c_str(), O_RDONLY, 0);
+   if (remote_file == nullptr)
+      throw std::logic_error("Encountered error in get(): couldn't open file at remote path '" + rpath + "'");
+
+   size_t total = 0;
+   while (total < len)
+   {
+      size_t want = static_cast<size_t>(std::min<uint64_t>(len - total, this->limits_.max_read_));
+      ssize_t rc = sftp_read(remote_file, buf + total, want);
+      if (rc <= 0)
+         break;
+      total += rc;
+   }
+
+   sftp_close(remote_file);
+   return total;
+}
+
+void sftp_connection::upload
+(
+   local_io & local,
+   ::sftp_file remote_file,
+   uint64_t offset,
+   uint64_t length,
+   const std::string & lpath,
+   const std::string & rpath,
+   const commit_fn & on_commit,
+   bool skip_holes
+)
+{
+   using clock_t = std::chrono::steady_clock;
+
+   const uint64_t end = (length == WHOLE_FILE) ? WHOLE_FILE : offset + length;
+
+   window_controller ctl(this->xfer_opts_, this->limits_.max_write_);
+   bandwidth_scheduler::flow flow(this->bandwidth_, this->xfer_opts_.weight_);
+   transfer_metrics & metrics = *this->metrics_;      // set by the caller's tracking scope
+   std::unique_ptr<char[]> buffer(new char[ctl.max_chunk_size()]);
+
+   if (sftp_seek64(remote_file, offset) != SSH_OK)
+      throw std::logic_error("Encountered error in put(): couldn't seek in remote file '" + rpath + "'");
+
+   // End of the local data extent being sent; holes past it are committed
+   // and skipped over. False once nothing but a hole remains.
+   uint64_t data_end = skip_holes ? offset : WHOLE_FILE;
+
+   auto seek_data = [&]() -> bool
+   {
+      uint64_t data = local.next_data(offset);
+      if (data >= end)
+         return false;
+
+      if (data > offset)
+      {
+         metrics.add_bytes(data - offset);
+         if (on_commit)
+            on_commit(offset, data - offset);
+
+         offset = data;
+         if (sftp_seek64(remote_file, offset) != SSH_OK)
+            throw std::logic_error("Encountered error in put(): couldn't seek in remote file '" + rpath + "'");
+      }
+
+      data_end = local.next_hole(offset);
+      return true;
+   };
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,11,0)
+   // WRITE payloads are copied into the outgoing packet by
+   // sftp_aio_begin_write(), so one buffer serves the whole window.
+   struct write_request
+   {
+      sftp_aio            aio_;
+      uint64_t            offset_;
+      size_t              length_;
+      clock_t::time_point sent_;
+   };
+
+   std::deque<write_request> in_flight;
+
+   auto short_write = [&](const write_request & req)
+   {
+      std::stringstream ss;
+      ss << "Encountered error in put(): I/O error writing remote file '"
+         << rpath << "' at offset " << req.offset_;
+      return std::logic_error(ss.str());
+   };
+
+   auto acked = [&](const write_request & req)
+   {
+      ctl.on_complete(clock_t::now() - req.sent_, req.length_);
+      metrics.add_bytes(req.length_);
+      metrics.set_rtt(ctl.rtt());
+      if (on_commit)
+         on_commit(req.offset_, req.length_);
+   };
+
+   try
+   {
+      bool eof = false;
+
+      while (!eof || !in_flight.empty())
+      {
+         while (!eof && in_flight.size() < ctl.window())
+         {
+            if (offset >= data_end && !seek_data())
+            {
+               eof = true;
+               break;
+            }
+
+            size_t want = static_cast<size_t>(std::min<uint64_t>({ctl.chunk_size(), end - offset, data_end - offset}));
+            ssize_t read_cnt =
+               metrics.timed(transfer_metrics::LOCAL_IO, [&] {return local.read(buffer.get(), want, offset);});
+            if (read_cnt < 0)
+               throw std::logic_error("Encountered error in put(): I/O error reading local file '" + lpath + "'");
+
+            if (read_cnt == 0)
+            {
+               eof = true;
+               break;
+            }
+
+            metrics.timed(transfer_metrics::THROTTLE, [&] {flow.acquire(read_cnt);});
+
+            // Blocks once the channel's send window is full.
+            write_request req = {nullptr, offset, static_cast<size_t>(read_cnt), clock_t::now()};
+            ssize_t sent =
+               metrics.timed
+               (
+                  transfer_metrics::NETWORK,
+                  [&]
+                  {
+                     session_guard guard(this->link_->lock_);
+                     return sftp_aio_begin_write(remote_file, buffer.get(), read_cnt, &req.aio_);
+                  }
+               );
+            if (sent != read_cnt)
+               throw short_write(req);
+
+            in_flight.push_back(req);
+            metrics.set_in_flight(in_flight.size());
+            offset += read_cnt;
+
+            if (static_cast<size_t>(read_cnt) < want || offset >= end)
+               eof = true;
+         }
+
+         if (in_flight.empty())
+            break;
+
+         // Reap whatever ACKs have already arrived, in any order, before
+         // blocking on the oldest outstanding one.
+         std::unique_lock<std::recursive_mutex> reaping(this->link_->lock_);
+         sftp_file_set_nonblocking(remote_file);
+         for (auto it = in_flight.begin(); it != in_flight.end(); )
+         {
+            ssize_t rc = sftp_aio_wait_write(&it->aio_);
+            if (rc == SSH_AGAIN)
+            {
+               ++it;
+               continue;
+            }
+
+            if (rc < 0 || static_cast<size_t>(rc) != it->length_)
+            {
+               sftp_file_set_blocking(remote_file);
+               throw short_write(*it);
+            }
+
+            acked(*it);
+            it = in_flight.erase(it);
+         }
+         sftp_file_set_blocking(remote_file);
+         reaping.unlock();
+
+         if (in_flight.size() >= ctl.window() || (eof && !in_flight.empty()))
+         {
+            write_request req = in_flight.front();
+            in_flight.pop_front();
+
+            ssize_t rc =
+               metrics.timed
+               (
+                  transfer_metrics::NETWORK,
+                  [&]
+                  {
+                     session_guard guard(this->link_->lock_);
+                     return sftp_aio_wait_write(&req.aio_);
+                  }
+               );
+            if (rc < 0 || static_cast<size_t>(rc) != req.length_)
+               throw short_write(req);
+
+            acked(req);
+         }
+
+         metrics.set_in_flight(in_flight.size());
+      }
+   }
+   catch (...)
+   {
+      session_guard guard(this->link_->lock_);
+      for (auto it = in_flight.begin(); it != in_flight.end(); ++it)
+         sftp_aio_free(it->aio_);
+      throw;
+   }
+#else
+   // No asynchronous WRITE before libssh 0.11; fall back to one blocking
+   // request at a time, still letting the controller pick the chunk size.
+   while (offset < end)
+   {
+      if (offset >= data_end && !seek_data())
+         break;
+
+      size_t want = static_cast<size_t>(std::min<uint64_t>({ctl.chunk_size(), end - offset, data_end - offset}));
+      ssize_t read_cnt =
+         metrics.timed(transfer_metrics::LOCAL_IO, [&] {return local.read(buffer.get(), want, offset);});
+      if (read_cnt < 0)
+         throw std::logic_error("Encountered error in put(): I/O error reading local file '" + lpath + "'");
+
+      if (read_cnt == 0)
+         break;
+
+      metrics.timed(transfer_metrics::THROTTLE, [&] {flow.acquire(read_cnt);});
+
+      clock_t::time_point sent = clock_t::now();
+      ssize_t write_cnt =
+         metrics.timed
+         (
+            transfer_metrics::NETWORK,
+            [&]
+            {
+               session_guard guard(this->link_->lock_);
+               return sftp_write(remote_file, buffer.get(), read_cnt);
+            }
+         );
+      if (write_cnt != read_cnt)
+      {
+         std::stringstream ss;
+         ss << "Encountered error in put(): I/O error writing remote file '"
+            << rpath << "' at offset " << offset;
+         throw std::logic_error(ss.str());
+      }
+
+      ctl.on_complete(clock_t::now() - sent, read_cnt);
+      metrics.add_bytes(read_cnt);
+      metrics.set_rtt(ctl.rtt());
+      if (on_commit)
+         on_commit(offset, read_cnt);
+      offset += read_cnt;
+   }
+#endif
+}
+
+void sftp_connection::download
+(
+   ::sftp_file remote_file,
+   local_io & local,
+   uint64_t offset,
+   uint64_t length,
+   const std::string & rpath,
+   const std::string & lpath,
+   const commit_fn & on_commit
+)
+{
+   using clock_t = std::chrono::steady_clock;
+
+   // Keep up to a window of READ requests outstanding; libssh queues
+   // replies by request id, so they are collected in issue order and
+   // written with pwrite() at the offset each one was requested for.
+   struct read_request
+   {
+      uint32_t            id_;
+      uint64_t            offset_;
+      uint32_t            length_;
+      clock_t::time_point sent_;
+   };
+
+   const uint64_t end = (length == WHOLE_FILE) ? WHOLE_FILE : offset + length;
+
+   window_controller ctl(this->xfer_opts_, this->limits_.max_read_);
+   bandwidth_scheduler::flow flow(this->bandwidth_, this->xfer_opts_.weight_);
+   transfer_metrics & metrics = *this->metrics_;      // set by the caller's tracking scope
+   std::unique_ptr<char[]> buffer(new char[ctl.max_chunk_size()]);
+   std::deque<read_request> in_flight;
+
+   if (sftp_seek64(remote_file, offset) != SSH_OK)
+      throw std::logic_error("Encountered error in get(): couldn't seek in remote file '" + rpath + "'");
+
+   uint64_t next_offset = offset;
+   bool eof = false;
+
+   while (!eof || !in_flight.empty())
+   {
+      while (!eof && next_offset < end && in_flight.size() < ctl.window())
+      {
+         uint32_t len = static_cast<uint32_t>(std::min<uint64_t>(ctl.chunk_size(), end - next_offset));
+         metrics.timed(transfer_metrics::THROTTLE, [&] {flow.acquire(len);});
+
+         int id =
+            metrics.timed
+            (
+               transfer_metrics::NETWORK,
+               [&]
+               {
+                  session_guard guard(this->link_->lock_);
+                  return sftp_async_read_begin(remote_file, len);
+               }
+            );
+         if (id < 0)
+            throw std::logic_error("Encountered error in get(): couldn't request data from remote file '" + rpath + "'");
+
+         in_flight.push_back({static_cast<uint32_t>(id), next_offset, len, clock_t::now()});
+         next_offset += len;
+      }
+
+      if (in_flight.empty())
+         break;
+
+      metrics.set_in_flight(in_flight.size());
+
+      read_request req = in_flight.front();
+      in_flight.pop_front();
+
+      int read_cnt =
+         metrics.timed
+         (
+            transfer_metrics::NETWORK,
+            [&]
+            {
+               session_guard guard(this->link_->lock_);
+               return sftp_async_read(remote_file, buffer.get(), req.length_, req.id_);
+            }
+         );
+      if (read_cnt < 0)
+      {
+         std::stringstream ss;
+         ss << "Encountered error in get(): I/O error reading remote file '"
+            << rpath << "' at offset " << req.offset_;
+         throw std::logic_error(ss.str());
+      }
+
+      ctl.on_complete(clock_t::now() - req.sent_, read_cnt);
+      metrics.set_rtt(ctl.rtt());
 
-   return sftp_file(attrib);
+      if (read_cnt == 0)
+      {
+         // Everything still in flight lies past EOF; drain it.
+         eof = true;
+         continue;
+      }
+
+      ssize_t write_cnt =
+         metrics.timed
+         (
+            transfer_metrics::LOCAL_IO,
+            [&]
+            {
+               return this->xfer_opts_.sparse_ ?
+                  local.write_sparse(buffer.get(), read_cnt, req.offset_) :
+                  local.write(buffer.get(), read_cnt, req.offset_);
+            }
+         );
+      if (write_cnt != read_cnt)
+         throw std::logic_error("Encountered error in get(): I/O error writing local file '" + lpath + "'");
+
+      metrics.add_bytes(read_cnt);
+
+      // Write-behind may still hold these bytes; commit them once they land.
+      if (on_commit)
+         local.when_written(req.offset_, read_cnt, on_commit);
+
+      if (static_cast<uint32_t>(read_cnt) < req.length_ && !eof)
+      {
+         // Short read, either a server-side length cap or the tail of the
+         // file; ask again for the remainder (a true EOF answers with 0).
+         uint64_t gap = req.offset_ + read_cnt;
+         uint32_t rest = req.length_ - static_cast<uint32_t>(read_cnt);
+
+         int id;
+         {
+            session_guard guard(this->link_->lock_);
+            sftp_seek64(remote_file, gap);
+            id = sftp_async_read_begin(remote_file, rest);
+            sftp_seek64(remote_file, next_offset);
+         }
+         if (id < 0)
+            throw std::logic_error("Encountered error in get(): couldn't request data from remote file '" + rpath + "'");
+
+         in_flight.push_front({static_cast<uint32_t>(id), gap, rest, clock_t::now()});
+      }
+   }
+}
+
+::sftp_file sftp_connection::open_remote(const char * path, int flags, mode_t mode)
+{
+   session_guard guard(this->link_->lock_);
+   return sftp_open(this->sftp_sess_, path, flags, mode);
+}
+
+int sftp_connection::close_remote(::sftp_file file)
+{
+   session_guard guard(this->link_->lock_);
+   return sftp_close(file);
+}
+
+std::string sftp_connection::base_name(const std::string & path)
+{
+   auto slash = path.find_last_of('/');
+   return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+std::string sftp_connection::dir_name(const std::string & path)
+{
+   auto slash = path.find_last_of('/');
+   if (slash == std::string::npos)
+      return ".";
+   return (slash == 0) ? std::string("/") : path.substr(0, slash);
+}
+
+void sftp_connection::truncate_remote(const std::string & rpath)
+{
+   std::string dest = this->resolve_path(rpath);
+   invalidating forget(*this, dest);
+
+   ::sftp_file remote_file =
+      this->open_remote(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+   if (remote_file == nullptr)
+      throw std::logic_error("Encountered error in put(): couldn't open file at remote path '" + rpath + "'");
+
+   this->close_remote(remote_file);
+}
+
+void sftp_connection::make_directory(const std::string & rpath, bool exist_ok)
+{
+   std::string path = this->resolve_path(rpath);
+   invalidating forget(*this, path, true);
+
+   session_guard guard(this->link_->lock_);
+
+   if (sftp_mkdir(this->sftp_sess_, path.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == SSH_OK)
+      return;
+
+   // Protocol v3 servers report an existing directory as a plain failure.
+   if (exist_ok)
+   {
+      sftp_attributes attrib = sftp_stat(this->sftp_sess_, path.c_str());
+      bool is_dir = (attrib != nullptr) && (attrib->type == SSH_FILEXFER_TYPE_DIRECTORY);
+      sftp_attributes_free(attrib);
+
+      if (is_dir)
+         return;
+   }
+
+   throw std::logic_error("Couldn't create remote directory '" + rpath + "'");
+}
+
+void sftp_connection::remove(const std::string & rpath)
+{
+   std::string path = this->resolve_path(rpath);
+   invalidating forget(*this, path, true);
+
+   session_guard guard(this->link_->lock_);
+
+   // lstat, so a symlink goes rather than what it points to.
+   sftp_attributes attrib = sftp_lstat(this->sftp_sess_, path.c_str());
+   if (attrib == nullptr)
+      throw std::logic_error("Couldn't stat object at '" + rpath + "'");
+
+   bool is_dir = (attrib->type == SSH_FILEXFER_TYPE_DIRECTORY);
+   sftp_attributes_free(attrib);
+
+   if (is_dir)
+   {
+      if (sftp_rmdir(this->sftp_sess_, path.c_str()) != SSH_OK)
+         throw std::logic_error("Couldn't remove remote directory '" + rpath + "'");
+   }
+   else if (sftp_unlink(this->sftp_sess_, path.c_str()) != SSH_OK)
+      throw std::logic_error("Couldn't remove remote file '" + rpath + "'");
+}
+
+bool sftp_connection::copy_on_server(const std::string & src, const std::string & dest, std::string & error)
+{
+   // An sftp-only account may answer any exec with the sftp subsystem and
+   // exit 0, so success is only trusted once cp has printed the marker.
+   static const std::string MARKER = "charon-cp-ok";
+
+   auto quote = [](const std::string & arg)
+   {
+      std::string out = "'";
+      for (auto it = arg.begin(); it != arg.end(); ++it)
+         out += (*it == '\'') ? std::string("'\\''") : std::string(1, *it);
+      return out + "'";
+   };
+
+   std::string cmd = "cp -- " + quote(src) + " " + quote(dest) + " && echo " + MARKER;
+
+   std::unique_lock<std::recursive_mutex> lock(this->link_->lock_);
+
+   ssh_channel channel = ssh_channel_new(this->ssh_sess_);
+   if (channel == nullptr)
+      return false;
+
+   if (ssh_channel_open_session(channel) != SSH_OK)
+   {
+      ssh_channel_free(channel);
+      return false;
+   }
+
+   std::string output;
+   if (ssh_channel_request_exec(channel, cmd.c_str()) == SSH_OK)
+   {
+      ssh_channel_send_eof(channel);
+
+      // cp may run a while; poll without blocking, and leave the link to
+      // sibling channels between polls. Its stderr is drained as we go, so
+      // a failure has something to say.
+      char buf[256];
+      for (;;)
+      {
+         int cnt = ssh_channel_read_nonblocking(channel, buf, sizeof(buf), 0);
+         if (cnt > 0)
+            output.append(buf, cnt);
+
+         int err_cnt = ssh_channel_read_nonblocking(channel, buf, sizeof(buf), 1);
+         if (err_cnt > 0)
+            error.append(buf, err_cnt);
+
+         if (cnt < 0 || err_cnt < 0 || ssh_channel_is_eof(channel))
+            break;
+
+         if (cnt == 0 && err_cnt == 0)
+         {
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            lock.lock();
+         }
+      }
+   }
+
+   int status = ssh_channel_get_exit_status(channel);
+   ssh_channel_close(channel);
+   ssh_channel_free(channel);
+
+   error.erase(error.find_last_not_of(" \t\r\n") + 1);
+   return status == 0 && output.find(MARKER) != std::string::npos;
+}
+
+void sftp_connection::relay(::sftp_file from, ::sftp_file to, const std::string & src, const std::string & dest)
+{
+   using clock_t = std::chrono::steady_clock;
+
+   struct read_request
+   {
+      uint32_t            id_;
+      uint64_t            offset_;
+      uint32_t            length_;
+      clock_t::time_point sent_;
+   };
+
+   window_controller ctl
+   (
+      this->xfer_opts_,
+      std::min(this->limits_.max_read_, this->limits_.max_write_)
+   );
+   bandwidth_scheduler::flow flow(this->bandwidth_, this->xfer_opts_.weight_);
+   transfer_metrics & metrics = *this->metrics_;      // set by the caller's tracking scope
+   std::unique_ptr<char[]> buffer(new char[ctl.max_chunk_size()]);
+   std::deque<read_request> reads;
+
+   auto write_error = [&dest](uint64_t offset)
+   {
+      std::stringstream ss;
+      ss << "Encountered error in cp(): I/O error writing remote file '" << dest << "' at offset " << offset;
+      return std::logic_error(ss.str());
+   };
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,11,0)
+   struct write_request
+   {
+      sftp_aio aio_;
+      uint64_t offset_;
+      size_t   length_;
+   };
+
+   std::deque<write_request> writes;
+
+   auto reap = [&]()
+   {
+      write_request req = writes.front();
+      writes.pop_front();
+
+      ssize_t rc =
+         metrics.timed
+         (
+            transfer_metrics::NETWORK,
+            [&]
+            {
+               session_guard guard(this->link_->lock_);
+               return sftp_aio_wait_write(&req.aio_);
+            }
+         );
+      if (rc < 0 || static_cast<size_t>(rc) != req.length_)
+         throw write_error(req.offset_);
+
+      metrics.add_bytes(req.length_);
+   };
+#endif
+
+   uint64_t next_offset = 0;
+   bool eof = false;
+
+   try
+   {
+      while (!eof || !reads.empty())
+      {
+         while (!eof && reads.size() < ctl.window())
+         {
+            uint32_t len = static_cast<uint32_t>(ctl.chunk_size());
+            metrics.timed(transfer_metrics::THROTTLE, [&] {flow.acquire(len);});
+
+            int id =
+               metrics.timed
+               (
+                  transfer_metrics::NETWORK,
+                  [&]
+                  {
+                     session_guard guard(this->link_->lock_);
+                     return sftp_async_read_begin(from, len);
+                  }
+               );
+            if (id < 0)
+               throw std::logic_error("Encountered error in cp(): couldn't request data from remote file '" + src + "'");
+
+            reads.push_back({static_cast<uint32_t>(id), next_offset, len, clock_t::now()});
+            next_offset += len;
+         }
+
+         metrics.set_in_flight(reads.size());
+
+         read_request req = reads.front();
+         reads.pop_front();
+
+         int read_cnt =
+            metrics.timed
+            (
+               transfer_metrics::NETWORK,
+               [&]
+               {
+                  session_guard guard(this->link_->lock_);
+                  return sftp_async_read(from, buffer.get(), req.length_, req.id_);
+               }
+            );
+         if (read_cnt < 0)
+            throw std::logic_error("Encountered error in cp(): I/O error reading remote file '" + src + "'");
+
+         ctl.on_complete(clock_t::now() - req.sent_, read_cnt);
+         metrics.set_rtt(ctl.rtt());
+
+         if (read_cnt == 0)
+         {
+            eof = true;
+            continue;
+         }
+
+         // Writes land wherever the file offset says; replies may be for
+         // a re-requested tail, so place each one explicitly.
+         sftp_seek64(to, req.offset_);
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,11,0)
+         write_request wreq = {nullptr, req.offset_, static_cast<size_t>(read_cnt)};
+         ssize_t sent =
+            metrics.timed
+            (
+               transfer_metrics::NETWORK,
+               [&]
+               {
+                  session_guard guard(this->link_->lock_);
+                  return sftp_aio_begin_write(to, buffer.get(), read_cnt, &wreq.aio_);
+               }
+            );
+         if (sent != read_cnt)
+            throw write_error(req.offset_);
+         writes.push_back(wreq);
+
+         while (writes.size() >= ctl.window())
+            reap();
+#else
+         ssize_t write_cnt =
+            metrics.timed
+            (
+               transfer_metrics::NETWORK,
+               [&]
+               {
+                  session_guard guard(this->link_->lock_);
+                  return sftp_write(to, buffer.get(), read_cnt);
+               }
+            );
+         if (write_cnt != read_cnt)
+            throw write_error(req.offset_);
+         metrics.add_bytes(read_cnt);
+#endif
+
+         if (static_cast<uint32_t>(read_cnt) < req.length_ && !eof)
+         {
+            uint64_t gap = req.offset_ + read_cnt;
+            uint32_t rest = req.length_ - static_cast<uint32_t>(read_cnt);
+
+            int id;
+            {
+               session_guard guard(this->link_->lock_);
+               sftp_seek64(from, gap);
+               id = sftp_async_read_begin(from, rest);
+               sftp_seek64(from, next_offset);
+            }
+            if (id < 0)
+               throw std::logic_error("Encountered error in cp(): couldn't request data from remote file '" + src + "'");
+
+            reads.push_front({static_cast<uint32_t>(id), gap, rest, clock_t::now()});
+         }
+      }
+
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,11,0)
+      while (!writes.empty())
+         reap();
+#endif
+   }
+   catch (...)
+   {
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0,11,0)
+      session_guard guard(this->link_->lock_);
+      for (auto it = writes.begin(); it != writes.end(); ++it)
+         sftp_aio_free(it->aio_);
+#endif
+      throw;
+   }
 }
 
-void sftp_connection::put(const std::string & lpath, const std::string & rpath)
+void sftp_connection::copy(const std::string & src, const std::string & dest, std::ostream & out)
 {
+   std::string from_path = this->resolve_path(src);
+   std::string to_path = this->resolve_path(dest);
+
+   // A missing or unreadable source is reported as that, before either
+   // way of copying gets to fail on it.
+   sftp_file source = this->stat(from_path);
+   if (!source.is_file())
+      throw std::logic_error("Encountered error in cp(): '" + src + "' is not a regular file");
+
+   // As with cp, a directory destination gets the file under its own name.
+   try
+   {
+      if (this->stat(to_path).is_directory())
+         to_path = this->resolve_path(to_path + "/" + base_name(from_path));
+   }
+   catch (const std::logic_error &)
+   {
+      // No such destination yet
+   }
+
+   if (to_path == from_path)
+      throw std::logic_error("Encountered error in cp(): '" + src + "' and '" + dest + "' are the same file");
+
+   invalidating forget(*this, to_path);
+
+   // Running a shell on the account is opt-in (set cp exec); by default
+   // the data is relayed.
+   std::string error;
+   if (this->xfer_opts_.cp_exec_)
+   {
+      if (this->copy_on_server(from_path, to_path, error))
+         return;
+
+      out << "*--Server-side copy failed";
+      if (!error.empty())
+         out << " (" << error << ")";
+      out << "; relaying '" << src << "' through the client" << std::endl;
+   }
+
+   ::sftp_file from = this->open_remote(from_path.c_str(), O_RDONLY, 0);
+   if (from == nullptr)
+      throw std::logic_error("Encountered error in cp(): couldn't open file at remote path '" + src + "'");
+
+   ::sftp_file to = this->open_remote(to_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+   if (to == nullptr)
+   {
+      this->close_remote(from);
+      throw std::logic_error("Encountered error in cp(): couldn't open file at remote path '" + dest + "'");
+   }
+
+   tracking track(*this, src + " -> " + dest, '=', source.get_size());
 
-   std::fstream local_file(lpath);
-   if (!local_file)
+   try
+   {
+      this->relay(from, to, src, dest);
+   }
+   catch (...)
+   {
+      this->close_remote(from);
+      this->close_remote(to);
+      throw;
+   }
+
+   this->close_remote(from);
+
+   if (this->close_remote(to) != SSH_OK)
+      throw std::logic_error("Encountered error in cp(): I/O error closing remote file '" + dest + "'");
+}
+
+void sftp_connection::put(const std::string & lpath, const std::string & rpath, bool resume, std::ostream * out)
+{
+   std::string dest = this->resolve_path((rpath.length() > 0) ? rpath : base_name(lpath));
+   invalidating forget(*this, dest);
+
+   local_io::io_ptr local = local_io::open(lpath, local_io::READ, this->xfer_opts_.io_backend_);
+   if (!local)
       throw std::logic_error("Encountered error in put(): couldn't open file at local path '" + lpath + "'");
 
+   struct stat st;
+   if (::fstat(local->fd(), &st) != 0)
+      throw std::logic_error("Encountered error in put(): couldn't stat file at local path '" + lpath + "'");
+
+   transfer_journal journal(absolute_path(lpath), dest, st.st_size, st.st_mtime);
+
+   // Only trust the journal as far as the remote partial file reaches.
+   uint64_t offset = resume ? journal.resume_offset() : 0;
+   if (offset > 0)
+   {
+      session_guard guard(this->link_->lock_);
+      sftp_attributes attrib = sftp_stat(this->sftp_sess_, dest.c_str());
+      if (attrib == nullptr || attrib->size < offset)
+         offset = 0;
+      sftp_attributes_free(attrib);
+   }
+
+   if (offset == 0)
+      journal.remove();
+   else if (out != nullptr)
+      *out << "*--Resuming upload of '" << lpath << "' at offset " << offset << std::endl;
+
    ::sftp_file remote_file = 
-      sftp_open
+      this->open_remote
       (
-         this->sftp_sess_, 
-         rpath.c_str(), 
-         O_WRONLY | O_CREAT | O_TRUNC,   // TO DO : make configurable
+         dest.c_str(), 
+         O_WRONLY | O_CREAT | ((offset > 0) ? 0 : O_TRUNC),   // TO DO : make configurable
          S_IRWXU              // TO DO : make configurable 
       ); 
 
    if (remote_file == nullptr)
       throw std::logic_error("Encountered error in put(): couldn't open file at remote path '" + rpath + "'");
 
-   // TO DO : configurable read buffer size
-   const int BUFF_SIZE = 4 * (1 << 20);
-   std::unique_ptr<char> buffer(new char[BUFF_SIZE]);
+   tracking track(*this, lpath, '>', st.st_size - offset);
+
    try
    {
-      int write_cnt = 0;
-      do 
-      {
-         std::streamsize read_cnt = local_file.readsome(buffer.get(), BUFF_SIZE);
-         if (!local_file || read_cnt < 1)
-            break;
+      this->upload
+      (
+         *local,
+         remote_file,
+         offset,
+         WHOLE_FILE,
+         lpath,
+         rpath,
+         [&journal](uint64_t o, uint64_t l) {journal.commit(o, l);},
+         this->xfer_opts_.sparse_
+      );
+
+      // A trailing hole was never written; give the remote file its size.
+      uint64_t size = static_cast<uint64_t>(st.st_size);
+      if (this->xfer_opts_.sparse_ && size > 0 && local->next_data(size - 1) != size - 1)
+         this->extend_remote(dest, size);
+   }
+   catch (...)
+   {
+      journal.flush();
+      this->close_remote(remote_file);
+      throw;
+   }
 
-         write_cnt = sftp_write(remote_file, buffer.get(), read_cnt);
-         if (write_cnt != read_cnt)
-            throw std::logic_error("Encountered error int put(): I/O error writing remote file '" + rpath + "'");
-      }
-      while (local_file.good());
-   
-      if (!local_file.good() && !local_file.eof())
-         throw std::logic_error("Encountered error int put(): I/O error reading local file '" + lpath + "'");
+   local->close();
+
+   if (this->close_remote(remote_file) != SSH_OK)
+   {
+      journal.flush();
+      throw std::logic_error("Encountered error in put(): I/O error closing remote file '" + rpath + "'");
+   }
+
+   journal.remove();
+}
+
+void sftp_connection::put_range
+(
+   const std::string & lpath,
+   const std::string & rpath,
+   uint64_t offset,
+   uint64_t length
+)
+{
+   this->put_ranges(lpath, rpath, range_list(1, std::make_pair(offset, length)), this->xfer_opts_.sparse_);
+}
+
+void sftp_connection::get(const std::string & rpath, const std::string & lpath, bool resume, std::ostream * out)
+{
+   std::string src = this->resolve_path(rpath);
+   std::string dest = (lpath.length() > 0) ? lpath : base_name(rpath);
+
+   ::sftp_file remote_file = this->open_remote(src.c_str(), O_RDONLY, 0);
+   if (remote_file == nullptr)
+      throw std::logic_error("Encountered error in get(): couldn't open file at remote path '" + rpath + "'");
+
+   sftp_attributes attrib;
+   {
+      session_guard guard(this->link_->lock_);
+      attrib = sftp_fstat(remote_file);
+   }
+   if (attrib == nullptr)
+   {
+      this->close_remote(remote_file);
+      throw std::logic_error("Encountered error in get(): couldn't stat file at remote path '" + rpath + "'");
+   }
 
-      sftp_close(remote_file);
+   uint64_t size = attrib->size;
+   transfer_journal journal(absolute_path(dest), src, attrib->size, attrib->mtime);
+   sftp_attributes_free(attrib);
+
+   // Only trust the journal as far as the local partial file reaches.
+   uint64_t offset = resume ? journal.resume_offset() : 0;
+   if (offset > 0)
+   {
+      struct stat st;
+      if (::stat(dest.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) < offset)
+         offset = 0;
+   }
+
+   if (offset == 0)
+      journal.remove();
+   else if (out != nullptr)
+      *out << "*--Resuming download of '" << rpath << "' at offset " << offset << std::endl;
+
+   local_io::io_ptr local =
+      local_io::open
+      (
+         dest,
+         (offset > 0) ? local_io::WRITE : local_io::WRITE_TRUNCATE,
+         this->xfer_opts_.io_backend_
+      );
+   if (!local)
+   {
+      this->close_remote(remote_file);
+      throw std::logic_error("Encountered error in get(): couldn't open file at local path '" + dest + "'");
+   }
+
+   if (!local->preallocate(size, this->xfer_opts_.sparse_))
+   {
+      this->close_remote(remote_file);
+      throw std::logic_error("Encountered error in get(): couldn't allocate local file '" + dest + "'");
+   }
+
+   tracking track(*this, rpath, '<', size - offset);
+
+   try
+   {
+      this->download
+      (
+         remote_file,
+         *local,
+         offset,
+         WHOLE_FILE,
+         rpath,
+         dest,
+         [&journal](uint64_t o, uint64_t l) {journal.commit(o, l);}
+      );
    }
    catch (...)
    {
-      sftp_close(remote_file);
+      journal.flush();
+      this->close_remote(remote_file);
       throw;
    }
 
+   this->close_remote(remote_file);
+
+   if (!local->close())
+   {
+      journal.flush();
+      throw std::logic_error("Encountered error in get(): I/O error closing local file '" + dest + "'");
+   }
+
+   journal.remove();
+}
+
+void sftp_connection::get_range
+(
+   const std::string & rpath,
+   const std::string & lpath,
+   uint64_t offset,
+   uint64_t length
+)
+{
+   std::string src = this->resolve_path(rpath);
+
+   ::sftp_file remote_file = this->open_remote(src.c_str(), O_RDONLY, 0);
+   if (remote_file == nullptr)
+      throw std::logic_error("Encountered error in get(): couldn't open file at remote path '" + rpath + "'");
+
+   local_io::io_ptr local = local_io::open(lpath, local_io::WRITE, this->xfer_opts_.io_backend_);
+   if (!local)
+   {
+      this->close_remote(remote_file);
+      throw std::logic_error("Encountered error in get(): couldn't open file at local path '" + lpath + "'");
+   }
+
+   tracking track(*this, rpath, '<', length);
+
+   try
+   {
+      this->download(remote_file, *local, offset, length, rpath, lpath);
+   }
+   catch (...)
+   {
+      this->close_remote(remote_file);
+      throw;
+   }
+
+   this->close_remote(remote_file);
+
+   if (!local->close())
+      throw std::logic_error("Encountered error in get(): I/O error closing local file '" + lpath + "'");
 }
 
-void sftp_connection::get(const std::string & rpath, const std::string & lpath)
+void sftp_connection::put_ranges
+(
+   const std::string & lpath,
+   const std::string & rpath,
+   const range_list & ranges,
+   bool skip_holes
+)
 {
+   std::string dest = this->resolve_path(rpath);
+   invalidating forget(*this, dest);
+
+   local_io::io_ptr local = local_io::open(lpath, local_io::READ, this->xfer_opts_.io_backend_);
+   if (!local)
+      throw std::logic_error("Encountered error in put(): couldn't open file at local path '" + lpath + "'");
+
+   ::sftp_file remote_file = this->open_remote(dest.c_str(), O_WRONLY, 0);
+   if (remote_file == nullptr)
+      throw std::logic_error("Encountered error in put(): couldn't open file at remote path '" + rpath + "'");
+
+   uint64_t total = 0;
+   for (auto it = ranges.begin(); it != ranges.end(); ++it)
+      total += it->second;
+
+   tracking track(*this, lpath, '>', total);
+
+   try
+   {
+      for (auto it = ranges.begin(); it != ranges.end(); ++it)
+         this->upload(*local, remote_file, it->first, it->second, lpath, rpath, nullptr, skip_holes);
+   }
+   catch (...)
+   {
+      this->close_remote(remote_file);
+      throw;
+   }
+
+   local->close();
+
+   if (this->close_remote(remote_file) != SSH_OK)
+      throw std::logic_error("Encountered error in put(): I/O error closing remote file '" + rpath + "'");
+}
+
+void sftp_connection::set_size(const std::string & rpath, uint64_t size)
+{
+   std::string path = this->resolve_path(rpath);
+   invalidating forget(*this, path);
+
+   session_guard guard(this->link_->lock_);
+
+   struct sftp_attributes_struct attrib;
+   memset(&attrib, 0, sizeof(attrib));
+   attrib.flags = SSH_FILEXFER_ATTR_SIZE;
+   attrib.size  = size;
+
+   if (sftp_setstat(this->sftp_sess_, path.c_str(), &attrib) != SSH_OK)
+      throw std::logic_error("Couldn't set size of remote file '" + rpath + "'");
+}
+
+void sftp_connection::extend_remote(const std::string & rpath, uint64_t size)
+{
+   std::string path = this->resolve_path(rpath);
+   invalidating forget(*this, path);
+
+   session_guard guard(this->link_->lock_);
+
+   struct sftp_attributes_struct attrib;
+   memset(&attrib, 0, sizeof(attrib));
+   attrib.flags = SSH_FILEXFER_ATTR_SIZE;
+   attrib.size  = size;
+
+   if (size == 0 || sftp_setstat(this->sftp_sess_, path.c_str(), &attrib) == SSH_OK)
+      return;
+
+   ::sftp_file remote_file = this->open_remote(path.c_str(), O_WRONLY, 0);
+   if (remote_file == nullptr)
+      throw std::logic_error("Encountered error in put(): couldn't open file at remote path '" + rpath + "'");
+
+   const char zero = 0;
+   bool ok = sftp_seek64(remote_file, size - 1) == SSH_OK && sftp_write(remote_file, &zero, 1) == 1;
+
+   if (this->close_remote(remote_file) != SSH_OK || !ok)
+      throw std::logic_error("Encountered error in put(): couldn't extend remote file '" + rpath + "'");
+}
+
+void sftp_connection::set_mod_time(const std::string & rpath, std::time_t mtime)
+{
+   std::string path = this->resolve_path(rpath);
+   invalidating forget(*this, path);
+
+   session_guard guard(this->link_->lock_);
+
+   struct timeval times[2];
+   times[0].tv_sec  = mtime;      // access
+   times[0].tv_usec = 0;
+   times[1].tv_sec  = mtime;      // modification
+   times[1].tv_usec = 0;
 
+   if (sftp_utimes(this->sftp_sess_, path.c_str(), times) != SSH_OK)
+      throw std::logic_error("Couldn't set modification time of remote file '" + rpath + "'");
 }
 
 }
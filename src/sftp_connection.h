@@ -1,16 +1,52 @@
 #ifndef SFTP_SESSION_H
 #define SFTP_SESSION_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <ostream>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <libssh/libssh.h>
+#include <libssh/callbacks.h>
 #include <libssh/sftp.h>
 
+#include "attribute_cache.h"
+#include "bandwidth_scheduler.h"
+#include "connect_cache.h"
+#include "local_io.h"
 #include "sftp_directory.h"
 #include "sftp_file.h"
+#include "transfer_metrics.h"
+#include "transfer_options.h"
 
 namespace charon {
 
+   // Per-request maxima the server will honour (limits@openssh.com).
+   struct sftp_limits_info
+   {
+      uint64_t max_read_;
+      uint64_t max_write_;
+   };
+
+   // Seconds spent in each step of bringing a channel up. Channels opened
+   // on an existing link spend nothing on the first four.
+   struct connect_timing
+   {
+      double tcp_;             // until the server's banner arrives
+      double kex_;
+      double hostkey_;
+      double auth_;
+      double sftp_init_;
+      double canonicalize_;
+   };
+
    class sftp_connection;
    using sftp_conn_ptr = std::shared_ptr<sftp_connection>;
    using sftp_dir_ptr = std::shared_ptr<sftp_directory>;
@@ -20,32 +56,231 @@ namespace charon {
       friend class sftp_server;
 
       private :
+         // Rough size of a file's attributes in a NAME/ATTRS reply.
+         static const size_t ATTRS_WIRE_SIZE = 64;
+
+         // One authenticated SSH connection, shared by every SFTP channel
+         // opened on it and closed with the last of them. libssh lets one
+         // thread into a session at a time, so each call on any of those
+         // channels holds lock_; the transfer engines take it per request
+         // so that sibling channels interleave.
+         struct ssh_link
+         {
+            ::ssh_session        sess_;
+            std::recursive_mutex lock_;
+            std::atomic<size_t>  channels_;     // open, or reserved by sftp_server
+
+
+            // ssh_connect() reports progress here; the first report past
+            // the socket connect marks the banner's arrival.
+            ::ssh_callbacks_struct                callbacks_;
+            std::chrono::steady_clock::time_point banner_;
+            bool                                  banner_seen_;
+
+            explicit ssh_link(::ssh_session sess) : sess_(sess), channels_(0), callbacks_(), banner_seen_(false) {}
+            ~ssh_link() {ssh_free(this->sess_);}
+
+            static void on_status(void * userdata, float status);
+         };
+         using link_ptr = std::shared_ptr<ssh_link>;
+         using session_guard = std::lock_guard<std::recursive_mutex>;
+
+         link_ptr          link_;
          ::ssh_session     ssh_sess_;
          ::sftp_session    sftp_sess_;
+         std::string       user_;
+         bool              compressed_;
+         std::string       home_;         // cwd at login, restored when pooled
          std::string       cwd_;
+         transfer_options  xfer_opts_;
+         sftp_limits_info  limits_;
+         bandwidth_scheduler * bandwidth_;
+         transfer_monitor *    monitor_;
+         attribute_cache *     attr_cache_;
+         metrics_ptr           metrics_;      // transfer in progress, if any
+         connect_timing        timing_;
+
+         // Publishes metrics for the engines while one put/get/cp runs;
+         // nested calls (put_range -> put_ranges) keep the outer one.
+         class tracking
+         {
+            private :
+               sftp_connection & conn_;
+               bool              owner_;
+
+            public :
+               tracking(sftp_connection & conn, const std::string & label, char direction, uint64_t total);
+               ~tracking();
+         };
+
+         // Drops a path being written from the attribute cache, both as
+         // the write starts and once it's over, so nothing looked up in
+         // between outlives it. tree for creations and removals.
+         class invalidating
+         {
+            private :
+               sftp_connection & conn_;
+               std::string       path_;
+               bool              tree_;
+
+               void forget();
+
+            public :
+               invalidating(sftp_connection & conn, const std::string & path, bool tree = false);
+               ~invalidating();
+         };
+
+         bool authenticate_server(const std::string & host, short port);
+         bool authenticate_user(const std::string & user, connect_cache & cache);
+         void query_limits();
+         void open_channel();
+
+         // Whether path is free of symlinks, so that a ".." after it may be
+         // resolved here: the working and login directories (and what
+         // leads to them) are canonical, as is anything the server
+         // canonicalized to itself.
+         bool known_canonical(const std::string & path) const;
+
+         // A directory which isn't a symlink, found by one LSTAT; cached
+         // as its own realpath when it is.
+         bool plain_directory(const std::string & path);
 
-         bool authenticate_server();
-         bool authenticate_user(const std::string & user);
+         // sftp_open() / sftp_close() under the link's lock.
+         ::sftp_file open_remote(const char * path, int flags, mode_t mode);
+         int         close_remote(::sftp_file file);
 
-         sftp_connection(const std::string & user, const std::string & host, short port);
+         // Whether the session is still up; with round_trip, whether the
+         // server's sftp subsystem still answers.
+         bool is_alive(bool round_trip);
+
+         // Called with each range the receiving side has confirmed.
+         using commit_fn = std::function<void(uint64_t, uint64_t)>;
+
+         // Pipelined engines moving [offset, offset+length) of an open file.
+         // With skip_holes, local holes are committed without being sent,
+         // so the remote range must already read as zeros.
+         void upload
+         (
+            local_io & local,
+            ::sftp_file remote_file,
+            uint64_t offset,
+            uint64_t length,
+            const std::string & lpath,
+            const std::string & rpath,
+            const commit_fn & on_commit = nullptr,
+            bool skip_holes = false
+         );
+         void download
+         (
+            ::sftp_file remote_file,
+            local_io & local,
+            uint64_t offset,
+            uint64_t length,
+            const std::string & rpath,
+            const std::string & lpath,
+            const commit_fn & on_commit = nullptr
+         );
+
+         // Server-side copy by running cp through an exec channel, only
+         // when asked for (set cp exec); false if cp didn't run or failed
+         // (e.g. an sftp-only account), with what it said on stderr.
+         bool copy_on_server(const std::string & src, const std::string & dest, std::string & error);
+
+         // Pipelined remote-to-remote copy relayed through this client.
+         void relay(::sftp_file from, ::sftp_file to, const std::string & src, const std::string & dest);
+
+         sftp_connection
+         (
+            const std::string & user,
+            const std::string & host,
+            short port,
+            bool compress = false,
+            bandwidth_scheduler * bandwidth = nullptr,
+            transfer_monitor * monitor = nullptr,
+            attribute_cache * attr_cache = nullptr
+         );
+
+         // A further SFTP channel on an already authenticated link.
+         sftp_connection
+         (
+            const link_ptr & link,
+            const std::string & user,
+            bool compress,
+            bandwidth_scheduler * bandwidth,
+            transfer_monitor * monitor,
+            attribute_cache * attr_cache
+         );
 
       public :
 
+         static const uint64_t WHOLE_FILE = std::numeric_limits<uint64_t>::max();
+
+         using range_list = std::vector<std::pair<uint64_t,uint64_t>>;   // offset, length
+
+         static std::string base_name(const std::string & path);
+         static std::string dir_name(const std::string & path);
+
          sftp_connection(const sftp_connection & rhs) = delete;
          sftp_connection & operator=(const sftp_connection & rhs) = delete;
 
          ~sftp_connection();
 
          std::string    canonicalize(const std::string & path);
+         // Absolute form of path against the working directory, with "."
+         // and empty segments dropped and ".." resolved where no symlink
+         // can be involved; anything from a doubtful ".." on is left for
+         // the server.
+         std::string    resolve_path(const std::string & path) const;
 
          void           change_directory(const std::string & path);
          void           print_working_directory() const;
+         const std::string & get_working_directory() const {return this->cwd_;}
+
+         const connect_timing & get_connect_timing() const {return this->timing_;}
+         void           print_connect_timing(std::ostream & out) const;
 
          sftp_directory read_directory(const std::string & path);
 
+         // Entries of a remote directory as they arrive, rather than once
+         // the last READDIR is in; returns how many there were.
+         using entry_fn = std::function<void(const sftp_file_ptr &)>;
+         size_t         list_directory(const std::string & path, const entry_fn & on_entry);
+
          sftp_file      stat(const std::string & path);
-         void           put(const std::string & lpath, const std::string & rpath = "");
-         void           get(const std::string & rpath, const std::string & lpath = "");
+
+         // Up to len bytes from the start of rpath, for sampling its contents.
+         size_t         peek(const std::string & rpath, char * buf, size_t len);
+
+         // A resumed transfer says where it picked up on out, if given.
+         void           put(const std::string & lpath, const std::string & rpath = "", bool resume = false, std::ostream * out = nullptr);
+         void           get(const std::string & rpath, const std::string & lpath = "", bool resume = false, std::ostream * out = nullptr);
+
+         // Move one byte range of a file which already exists on the
+         // receiving side; used by striped transfers. put_range() expects
+         // a freshly truncated remote file and skips local holes.
+         void           put_range(const std::string & lpath, const std::string & rpath, uint64_t offset, uint64_t length);
+         void           get_range(const std::string & rpath, const std::string & lpath, uint64_t offset, uint64_t length);
+         void           put_ranges(const std::string & lpath, const std::string & rpath, const range_list & ranges, bool skip_holes = false);
+         void           truncate_remote(const std::string & rpath);
+         void           make_directory(const std::string & rpath, bool exist_ok = false);
+
+         // Deletes a file, or a directory which is already empty.
+         void           remove(const std::string & rpath);
+
+         // Remote-to-remote copy, on the server itself where possible.
+         void           copy(const std::string & src, const std::string & dest, std::ostream & out);
+
+         // Grows rpath to size, writing its last byte where the server
+         // won't change the size through SETSTAT.
+         void           extend_remote(const std::string & rpath, uint64_t size);
+
+         void           set_size(const std::string & rpath, uint64_t size);
+         void           set_mod_time(const std::string & rpath, std::time_t mtime);
+
+         const transfer_options & get_transfer_options() const {return this->xfer_opts_;}
+         void set_transfer_options(const transfer_options & opts) {this->xfer_opts_ = opts;}
+
+         const sftp_limits_info & get_limits() const {return this->limits_;}
    };
 }
 
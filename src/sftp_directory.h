@@ -37,11 +37,11 @@ namespace charon {
    };
 
 
+   // Column titles for a listing, ahead of its entries.
    template<typename charT=char, typename traits=std::char_traits<charT> >
-   std::basic_ostream<charT,traits> & operator<<
+   std::basic_ostream<charT,traits> & print_listing_header
    (
-      std::basic_ostream<charT,traits> & os, 
-      sftp_directory & sd
+      std::basic_ostream<charT,traits> & os
    )
    {
       os << std::setfill('=') << std::setw(80) << "=" <<  std::endl;
@@ -60,6 +60,18 @@ namespace charon {
       os << std::setfill('=') << std::setw(80) << "=" <<  std::endl;
       os << std::setfill(' ');
 
+      return os;
+   }
+
+   template<typename charT=char, typename traits=std::char_traits<charT> >
+   std::basic_ostream<charT,traits> & operator<<
+   (
+      std::basic_ostream<charT,traits> & os, 
+      sftp_directory & sd
+   )
+   {
+      print_listing_header(os);
+
       //os << "Name                       Size Perms    Owner\tGroup\n";
       for (auto it = sd.begin(); it != sd.end(); ++it)
          os << *it->get();
@@ -297,49 +297,49 @@ date_time   sftp_file::get_mod_time() const
 
 bool sftp_file::is_directory() const
 {
-   return (this->get_type() & SSH_FILEXFER_TYPE_DIRECTORY) > 0;
+   return this->get_type() == SSH_FILEXFER_TYPE_DIRECTORY;
 }
 
 bool sftp_file::is_file() const
 {
 
-   return (this->get_type() & SSH_FILEXFER_TYPE_REGULAR) > 0;
+   return this->get_type() == SSH_FILEXFER_TYPE_REGULAR;
 }
 
-void sftp_file::print_stat() const
+void sftp_file::print_stat(std::ostream & os) const
 {
-   std::cout << std::setfill('=') << std::setw(80) << "=" <<  std::endl;
-   std::cout << std::setfill(' ');
-   std::cout << std::setw(43)     << std::right    << "Stat"  << std::endl;
-   std::cout << std::setfill('=') << std::setw(80) << "=" <<  std::endl;
-   std::cout << std::setfill(' ');
-
-   std::cout << std::right << std::setw(7)   << "Name:" << " "
-             << std::left  << std::setw(32)  << this->file_->name;
-   std::cout << std::right << std::setw(7)   << "Size:" << " "
-             << std::left  << std::setw(32)  <<this->file_->size     << std::endl;
-
-   std::cout << std::right << std::setw(7)   << "Access:" << " "
-             << std::left  << std::setw(32)  << this->get_permissions_str();
-   std::cout << std::right << std::setw(7)   << "Type:" << " "
-             << std::left  << std::setw(32)  <<this->get_type_str()  << std::endl;
-
-   std::cout << std::right << std::setw(7)   << "Owner:" << " "
-             << std::left  << std::setw(32)  << this->get_uid();
-   std::cout << std::right << std::setw(7)   << "Group:" << " "
-             << std::left  << std::setw(32)  <<this->get_gid()  << std::endl;
-
-   std::cout << std::right << std::setw(7)   << "AccsTm:" << " "
-             << std::left  << std::setw(10)  
-             << this->get_access_time().format_str("%Y-%m-%d")  
-             << std::left  << std::setw(22)  
-             << this->get_access_time().format_str("T%H:%M:%S"); 
-   std::cout << std::right << std::setw(7)   << "ModTm:" << " "
-             << std::left  << std::setw(10)  
-             << this->get_mod_time().format_str("%Y-%m-%d")  
-             << std::left  << std::setw(22)  
-             << this->get_mod_time().format_str("T%H:%M:%S") 
-             << std::endl;
+   os << std::setfill('=') << std::setw(80) << "=" <<  std::endl;
+   os << std::setfill(' ');
+   os << std::setw(43)     << std::right    << "Stat"  << std::endl;
+   os << std::setfill('=') << std::setw(80) << "=" <<  std::endl;
+   os << std::setfill(' ');
+
+   os << std::right << std::setw(7)   << "Name:" << " "
+      << std::left  << std::setw(32)  << this->file_->name;
+   os << std::right << std::setw(7)   << "Size:" << " "
+      << std::left  << std::setw(32)  <<this->file_->size     << std::endl;
+
+   os << std::right << std::setw(7)   << "Access:" << " "
+      << std::left  << std::setw(32)  << this->get_permissions_str();
+   os << std::right << std::setw(7)   << "Type:" << " "
+      << std::left  << std::setw(32)  <<this->get_type_str()  << std::endl;
+
+   os << std::right << std::setw(7)   << "Owner:" << " "
+      << std::left  << std::setw(32)  << this->get_uid();
+   os << std::right << std::setw(7)   << "Group:" << " "
+      << std::left  << std::setw(32)  <<this->get_gid()  << std::endl;
+
+   os << std::right << std::setw(7)   << "AccsTm:" << " "
+      << std::left  << std::setw(10)  
+      << this->get_access_time().format_str("%Y-%m-%d")  
+      << std::left  << std::setw(22)  
+      << this->get_access_time().format_str("T%H:%M:%S"); 
+   os << std::right << std::setw(7)   << "ModTm:" << " "
+      << std::left  << std::setw(10)  
+      << this->get_mod_time().format_str("%Y-%m-%d")  
+      << std::left  << std::setw(22)  
+      << this->get_mod_time().format_str("T%H:%M:%S") 
+      << std::endl;
 }
 
 sftp_file::~sftp_file()
@@ -51,7 +51,7 @@ namespace charon {
          bool        is_directory() const;
          bool        is_file() const;
 
-         void        print_stat() const;
+         void        print_stat(std::ostream & os) const;
 
          ~sftp_file();
    };
@@ -12,19 +12,177 @@ namespace charon {
 
 sftp_server::sftp_server(const std::string & host, short port)
    : host_(host),
-     port_(port)
+     port_(port),
+     channels_(1),
+     idle_timeout_(60)
 {
 }
 
-sftp_conn_ptr sftp_server::connect(const std::string & user)
+sftp_conn_ptr sftp_server::connect(const std::string & user, bool compress)
 {
-   return sftp_conn_ptr(new sftp_connection(user, this->host_, this->port_));
+   sftp_conn_ptr conn(new sftp_connection(user, this->host_, this->port_, compress, &this->bandwidth_, &this->monitor_, &this->attr_cache_));
+
+   std::lock_guard<std::mutex> guard(this->pool_lock_);
+   this->prune();
+   this->live_.push_back(conn);
+   return conn;
+}
+
+void sftp_server::prune() const
+{
+   auto it = this->live_.begin();
+   while (it != this->live_.end())
+   {
+      if (it->expired())
+         it = this->live_.erase(it);
+      else
+         ++it;
+   }
+}
+
+std::vector<sftp_conn_ptr> sftp_server::evict(clock::time_point now)
+{
+   std::vector<sftp_conn_ptr> evicted;
+
+   auto it = this->idle_.begin();
+   while (it != this->idle_.end())
+   {
+      if (now - it->since_ > std::chrono::seconds(this->idle_timeout_))
+      {
+         evicted.push_back(it->conn_);
+         it = this->idle_.erase(it);
+      }
+      else
+         ++it;
+   }
+
+   // Oldest first.
+   while (this->idle_.size() > MAX_IDLE)
+   {
+      evicted.push_back(this->idle_.front().conn_);
+      this->idle_.erase(this->idle_.begin());
+   }
+
+   return evicted;
+}
+
+sftp_conn_ptr sftp_server::checkout(const std::string & user, bool compress)
+{
+   for (;;)
+   {
+      clock::time_point now = clock::now();
+      std::vector<sftp_conn_ptr> evicted;
+      sftp_conn_ptr conn;
+      bool probe = false;
+
+      {
+         std::lock_guard<std::mutex> guard(this->pool_lock_);
+         evicted = this->evict(now);
+
+         // Most recently used first; its server side is likeliest alive.
+         for (auto it = this->idle_.rbegin(); it != this->idle_.rend(); ++it)
+         {
+            if (it->conn_->user_ == user && it->conn_->compressed_ == compress)
+            {
+               conn = it->conn_;
+               probe = (now - it->since_ > std::chrono::seconds(HEALTH_INTERVAL_SECS));
+               this->idle_.erase(std::next(it).base());
+               break;
+            }
+         }
+      }
+
+      if (!conn)
+         break;
+
+      if (conn->is_alive(probe))
+         return conn;
+   }
+
+   sftp_conn_ptr conn = this->open_channel(user, compress);
+   if (conn)
+      return conn;
+
+   return this->connect(user, compress);
+}
+
+sftp_conn_ptr sftp_server::open_channel(const std::string & user, bool compress)
+{
+   if (this->channels_ < 2)
+      return nullptr;
+
+   sftp_connection::link_ptr link;
+   {
+      std::lock_guard<std::mutex> guard(this->pool_lock_);
+      this->prune();
+
+      // The slot is taken here, under the lock, so concurrent checkouts
+      // can't all pick the same link and go past channels_.
+      size_t best = this->channels_;
+      for (auto it = this->live_.begin(); it != this->live_.end(); ++it)
+      {
+         sftp_conn_ptr conn = it->lock();
+         if (!conn || conn->user_ != user || conn->compressed_ != compress)
+            continue;
+
+         size_t used = conn->link_->channels_.load();
+         if (used < best)
+         {
+            best = used;
+            link = conn->link_;
+         }
+      }
+
+      if (link)
+         ++link->channels_;
+   }
+
+   if (!link)
+      return nullptr;
+
+   sftp_conn_ptr conn;
+   try
+   {
+      conn.reset(new sftp_connection(link, user, compress, &this->bandwidth_, &this->monitor_, &this->attr_cache_));
+   }
+   catch (const std::exception &)
+   {
+      // Refused (MaxSessions and the like); checkout() connects afresh.
+      --link->channels_;
+      return nullptr;
+   }
+
+   std::lock_guard<std::mutex> guard(this->pool_lock_);
+   this->live_.push_back(conn);
+   return conn;
+}
+
+void sftp_server::checkin(const sftp_conn_ptr & conn)
+{
+   if (!conn || !conn->is_alive(false))
+      return;
+
+   conn->cwd_ = conn->home_;
+   conn->xfer_opts_ = transfer_options();
+
+   std::vector<sftp_conn_ptr> evicted;
+
+   std::lock_guard<std::mutex> guard(this->pool_lock_);
+   clock::time_point now = clock::now();
+   this->idle_.push_back({conn, now});
+   evicted = this->evict(now);
+}
+
+size_t sftp_server::connection_count() const
+{
+   std::lock_guard<std::mutex> guard(this->pool_lock_);
+   this->prune();
+   return this->live_.size();
 }
 
 bool sftp_server::is_connected() const
 {
-   // TO DO : track created connections & report them
-   return true;
+   return this->connection_count() > 0;
 }
 
 }
@@ -1,8 +1,15 @@
 #ifndef SFTP_SERVER_H
 #define SFTP_SERVER_H
 
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
+
+#include "attribute_cache.h"
+#include "bandwidth_scheduler.h"
+#include "transfer_metrics.h"
 
 namespace charon {
 /*
@@ -22,8 +29,42 @@ namespace charon {
    {
       private :
 
+         using clock = std::chrono::steady_clock;
+
+         // Idle sessions kept for reuse. Those idle past HEALTH_INTERVAL
+         // are probed before being handed out again; those idle past
+         // idle_timeout_, or beyond MAX_IDLE, are closed.
+         static const size_t MAX_IDLE = 16;
+         static const int    HEALTH_INTERVAL_SECS = 5;
+
+         struct pooled_conn
+         {
+            sftp_conn_ptr      conn_;
+            clock::time_point  since_;
+         };
+
          std::string host_;
          short       port_;
+         size_t      channels_;       // SFTP channels per SSH connection
+         int         idle_timeout_;   // seconds
+
+         // Shared by every connection made here.
+         bandwidth_scheduler bandwidth_;
+         transfer_monitor    monitor_;
+         attribute_cache     attr_cache_;
+
+         mutable std::mutex                          pool_lock_;
+         std::vector<pooled_conn>                    idle_;
+         mutable std::vector<std::weak_ptr<sftp_connection>> live_;
+
+         // Caller holds pool_lock_; returns what it evicted so the
+         // sessions are closed outside the lock.
+         std::vector<sftp_conn_ptr> evict(clock::time_point now);
+         void                       prune() const;     // drop closed sessions from live_
+
+         // A new channel on the least busy link with room for one, or
+         // nullptr when every link is full.
+         sftp_conn_ptr open_channel(const std::string & user, bool compress);
 
       public :
 
@@ -33,12 +74,32 @@ namespace charon {
 
          ~sftp_server() {};
 
-         sftp_conn_ptr connect(const std::string & user);
+         // Always a fresh, authenticated session.
+         sftp_conn_ptr connect(const std::string & user, bool compress = false);
+
+         // A pooled session for user where one is idle, else a new one:
+         // a further channel on an open connection while channels allows,
+         // or a fresh connection. Checked-in sessions go back to their
+         // login directory and default options.
+         sftp_conn_ptr checkout(const std::string & user, bool compress = false);
+         void          checkin(const sftp_conn_ptr & conn);
 
+         size_t      connection_count() const;   // open, pooled or not
          bool        is_connected() const;
          std::string get_host() const {return this->host_;}
          short       get_port() const {return this->port_;}
 
+         // More than 1 multiplexes new sessions over existing connections,
+         // for hosts that limit how many may be made.
+         void   set_channels(size_t channels) {this->channels_ = (channels > 0) ? channels : 1;}
+         size_t get_channels() const {return this->channels_;}
+
+         void   set_idle_timeout(int secs) {this->idle_timeout_ = secs;}
+
+         bandwidth_scheduler & get_bandwidth() {return this->bandwidth_;}
+         transfer_monitor &    get_monitor() {return this->monitor_;}
+         attribute_cache &     get_attribute_cache() {return this->attr_cache_;}
+
    };
 }
 
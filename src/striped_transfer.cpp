@@ -0,0 +1,175 @@
+#include <exception>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "concurrent/thread_pool.h"
+
+#include "local_io.h"
+#include "striped_transfer.h"
+
+namespace charon {
+
+striped_transfer::striped_transfer(sftp_server & server, const std::string & user)
+   : server_(server),
+     user_(user)
+{
+}
+
+size_t striped_transfer::stripe_count(uint64_t size, const transfer_options & opts) const
+{
+   uint64_t cnt = (size + MIN_STRIPE_SIZE - 1) / MIN_STRIPE_SIZE;
+   if (cnt > opts.stripes_)
+      cnt = opts.stripes_;
+
+   return (cnt > 0) ? static_cast<size_t>(cnt) : 1;
+}
+
+void striped_transfer::run(uint64_t size, const transfer_options & opts, const range_fn & fn)
+{
+   using sk3l::concurrent::thread_pool;
+   using sk3l::concurrent::thread_pool_job_base;
+   using sk3l::concurrent::thread_pool_job_rv;
+
+   size_t stripes = this->stripe_count(size, opts);
+
+   // Keep stripe boundaries on request boundaries.
+   uint64_t stride = (size + stripes - 1) / stripes;
+   stride = ((stride + opts.chunk_size_ - 1) / opts.chunk_size_) * opts.chunk_size_;
+
+   // The first session is brought up here, so that any host key or
+   // password prompt is answered once before the stripes race to connect.
+   sftp_conn_ptr first = this->server_.checkout(this->user_);
+
+   thread_pool pool(stripes);
+   std::vector<std::future<void>> results;
+
+   for (uint64_t offset = 0; offset < size; offset += stride)
+   {
+      uint64_t length = std::min(stride, size - offset);
+
+      sftp_conn_ptr conn;
+      conn.swap(first);
+
+      std::shared_ptr<std::promise<void>> done(new std::promise<void>());
+      results.push_back(done->get_future());
+
+      pool.post
+      (
+         std::shared_ptr<thread_pool_job_base>
+         (
+            new thread_pool_job_rv<void>
+            (
+               [this, &opts, &fn, done, offset, length, conn]() mutable
+               {
+                  try
+                  {
+                     if (!conn)
+                        conn = this->server_.checkout(this->user_);
+                     conn->set_transfer_options(opts);
+                     fn(*conn, offset, length);
+                     this->server_.checkin(conn);
+                     done->set_value();
+                  }
+                  catch (...)
+                  {
+                     done->set_exception(std::current_exception());
+                  }
+               }
+            )
+         )
+      );
+   }
+
+   // Wait for every stripe before reporting the first failure.
+   std::exception_ptr err;
+   for (auto it = results.begin(); it != results.end(); ++it)
+   {
+      try
+      {
+         it->get();
+      }
+      catch (...)
+      {
+         if (!err)
+            err = std::current_exception();
+      }
+   }
+
+   pool.shutdown();
+
+   if (err)
+      std::rethrow_exception(err);
+}
+
+void striped_transfer::put(sftp_connection & primary, const std::string & lpath, const std::string & rpath)
+{
+   struct stat st;
+   if (::stat(lpath.c_str(), &st) != 0)
+      throw std::logic_error("Encountered error in put(): couldn't stat file at local path '" + lpath + "'");
+
+   transfer_options opts = primary.get_transfer_options();
+   uint64_t size = static_cast<uint64_t>(st.st_size);
+
+   if (this->stripe_count(size, opts) < 2)
+   {
+      primary.put(lpath, rpath);
+      return;
+   }
+
+   std::string dest =
+      primary.resolve_path((rpath.length() > 0) ? rpath : sftp_connection::base_name(lpath));
+
+   primary.truncate_remote(dest);
+
+   // Stripes skip local holes, so size the remote file for a trailing one.
+   if (opts.sparse_)
+      primary.extend_remote(dest, size);
+
+   this->run
+   (
+      size,
+      opts,
+      [&lpath, &dest](sftp_connection & conn, uint64_t offset, uint64_t length)
+      {
+         conn.put_range(lpath, dest, offset, length);
+      }
+   );
+}
+
+void striped_transfer::get(sftp_connection & primary, const std::string & rpath, const std::string & lpath)
+{
+   std::string src = primary.resolve_path(rpath);
+   std::string dest = (lpath.length() > 0) ? lpath : sftp_connection::base_name(rpath);
+
+   transfer_options opts = primary.get_transfer_options();
+   uint64_t size = primary.stat(src).get_size();
+
+   if (this->stripe_count(size, opts) < 2)
+   {
+      primary.get(rpath, lpath);
+      return;
+   }
+
+   local_io::io_ptr local = local_io::open(dest, local_io::WRITE_TRUNCATE, IO_PREAD);
+   if (!local)
+      throw std::logic_error("Encountered error in get(): couldn't open file at local path '" + dest + "'");
+
+   if (!local->preallocate(size, opts.sparse_))
+      throw std::logic_error("Encountered error in get(): couldn't allocate local file '" + dest + "'");
+   local->close();
+
+   this->run
+   (
+      size,
+      opts,
+      [&src, &dest](sftp_connection & conn, uint64_t offset, uint64_t length)
+      {
+         conn.get_range(src, dest, offset, length);
+      }
+   );
+}
+
+}
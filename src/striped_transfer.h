@@ -0,0 +1,41 @@
+#ifndef STRIPED_TRANSFER_H
+#define STRIPED_TRANSFER_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "sftp_connection.h"
+#include "sftp_server.h"
+
+namespace charon {
+
+   // Moves a single file as contiguous byte ranges, each over its own
+   // sftp_connection checked out of sftp_server's pool.
+   class striped_transfer
+   {
+      private :
+         using range_fn = std::function<void(sftp_connection &, uint64_t, uint64_t)>;
+
+         // Ranges smaller than this aren't worth a handshake of their own.
+         static const uint64_t MIN_STRIPE_SIZE = 64 * (1 << 20);
+
+         sftp_server &  server_;
+         std::string    user_;
+
+         size_t stripe_count(uint64_t size, const transfer_options & opts) const;
+         void   run(uint64_t size, const transfer_options & opts, const range_fn & fn);
+
+      public :
+
+         striped_transfer(sftp_server & server, const std::string & user);
+
+         striped_transfer(const striped_transfer & rhs) = delete;
+         striped_transfer & operator=(const striped_transfer & rhs) = delete;
+
+         void put(sftp_connection & primary, const std::string & lpath, const std::string & rpath = "");
+         void get(sftp_connection & primary, const std::string & rpath, const std::string & lpath = "");
+   };
+}
+
+#endif // STRIPED_TRANSFER_H
@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <exception>
+#include <iterator>
+#include <fstream>
+
+#include "local_state.h"
+#include "transfer_journal.h"
+
+namespace charon {
+
+transfer_journal::transfer_journal
+(
+   const std::string & lpath,
+   const std::string & rpath,
+   uint64_t size,
+   uint64_t mtime
+)
+   : lpath_(lpath),
+     rpath_(rpath),
+     size_(size),
+     mtime_(mtime),
+     unflushed_(0)
+{
+   try
+   {
+      this->file_ = state_path("journal/" + state_key(lpath + '\n' + rpath));
+   }
+   catch (const std::exception &)
+   {
+      // No state directory; the transfer runs without a journal.
+      return;
+   }
+
+   this->load();
+}
+
+void transfer_journal::load()
+{
+   std::ifstream in(this->file_);
+   if (!in)
+      return;
+
+   std::string lpath, rpath;
+   uint64_t size = 0, mtime = 0;
+
+   std::getline(in, lpath);
+   std::getline(in, rpath);
+   in >> size >> mtime;
+
+   // Journal is for a different (or since modified) source; start over.
+   if (!in || lpath != this->lpath_ || rpath != this->rpath_ ||
+       size != this->size_ || mtime != this->mtime_)
+      return;
+
+   uint64_t start, end;
+   while (in >> start >> end)
+      this->ranges_[start] = end;
+}
+
+uint64_t transfer_journal::resume_offset() const
+{
+   auto it = this->ranges_.find(0);
+   return (it == this->ranges_.end()) ? 0 : it->second;
+}
+
+void transfer_journal::commit(uint64_t offset, uint64_t length)
+{
+   if (length == 0)
+      return;
+
+   uint64_t start = offset;
+   uint64_t end = offset + length;
+
+   // Merge with any ranges touching [start, end)
+   auto it = this->ranges_.upper_bound(start);
+   if (it != this->ranges_.begin())
+   {
+      auto prev = std::prev(it);
+      if (prev->second >= start)
+      {
+         start = prev->first;
+         if (prev->second > end)
+            end = prev->second;
+         it = this->ranges_.erase(prev);
+      }
+   }
+
+   while (it != this->ranges_.end() && it->first <= end)
+   {
+      if (it->second > end)
+         end = it->second;
+      it = this->ranges_.erase(it);
+   }
+
+   this->ranges_[start] = end;
+
+   this->unflushed_ += length;
+   if (this->unflushed_ >= CHECKPOINT_BYTES)
+      this->flush();
+}
+
+void transfer_journal::flush()
+{
+   if (this->file_.empty())
+      return;
+
+   std::string tmp = this->file_ + ".tmp";
+   {
+      std::ofstream out(tmp, std::ios::trunc);
+      out << this->lpath_ << '\n'
+          << this->rpath_ << '\n'
+          << this->size_ << ' ' << this->mtime_ << '\n';
+
+      for (auto it = this->ranges_.begin(); it != this->ranges_.end(); ++it)
+         out << it->first << ' ' << it->second << '\n';
+
+      if (!out)
+         return;       // best effort; a lost checkpoint only costs a retransfer
+   }
+
+   std::rename(tmp.c_str(), this->file_.c_str());
+   this->unflushed_ = 0;
+}
+
+void transfer_journal::remove()
+{
+   if (!this->file_.empty())
+      std::remove(this->file_.c_str());
+   this->ranges_.clear();
+   this->unflushed_ = 0;
+}
+
+}
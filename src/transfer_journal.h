@@ -0,0 +1,51 @@
+#ifndef TRANSFER_JOURNAL_H
+#define TRANSFER_JOURNAL_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace charon {
+
+   // On-disk record of the byte ranges of one transfer that the receiving
+   // side has confirmed, keyed by both paths plus the source's size and
+   // mtime so a changed source never resumes into a stale partial file.
+   class transfer_journal
+   {
+      private :
+         // Confirmed bytes between rewrites of the journal file.
+         static const uint64_t CHECKPOINT_BYTES = 16 * (1 << 20);
+
+         std::string                  lpath_;
+         std::string                  rpath_;
+         uint64_t                     size_;
+         uint64_t                     mtime_;
+         std::string                  file_;
+         std::map<uint64_t,uint64_t>  ranges_;     // start -> end
+         uint64_t                     unflushed_;
+
+         void load();
+
+      public :
+
+         transfer_journal
+         (
+            const std::string & lpath,
+            const std::string & rpath,
+            uint64_t size,
+            uint64_t mtime
+         );
+
+         transfer_journal(const transfer_journal & rhs) = delete;
+         transfer_journal & operator=(const transfer_journal & rhs) = delete;
+
+         // End of the confirmed range starting at byte 0.
+         uint64_t resume_offset() const;
+
+         void commit(uint64_t offset, uint64_t length);
+         void flush();
+         void remove();
+   };
+}
+
+#endif // TRANSFER_JOURNAL_H
@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "transfer_metrics.h"
+
+namespace charon {
+
+transfer_metrics::transfer_metrics(const std::string & label, char direction, uint64_t total)
+   : label_(label),
+     direction_(direction),
+     start_(clock_t::now()),
+     total_(total),
+     bytes_(0),
+     in_flight_(0),
+     rtt_us_(0),
+     end_ns_(-1),
+     failed_(false),
+     sample_time_(start_),
+     sample_bytes_(0),
+     rate_(0)
+{
+   for (size_t i = 0; i < 3; ++i)
+      this->phase_ns_[i].store(0);
+}
+
+void transfer_metrics::add_time(phase p, clock_t::duration d)
+{
+   this->phase_ns_[p].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+}
+
+void transfer_metrics::set_rtt(double seconds)
+{
+   this->rtt_us_.store(static_cast<uint64_t>(seconds * 1e6));
+}
+
+void transfer_metrics::finish(bool failed)
+{
+   this->failed_.store(failed);
+   this->in_flight_.store(0);
+   this->end_ns_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_t::now() - this->start_).count());
+}
+
+double transfer_metrics::elapsed() const
+{
+   int64_t end = this->end_ns_.load();
+   if (end >= 0)
+      return end / 1e9;
+
+   return std::chrono::duration<double>(clock_t::now() - this->start_).count();
+}
+
+double transfer_metrics::phase_share(phase p) const
+{
+   double secs = this->elapsed();
+   return (secs > 0) ? std::min(1.0, this->phase_ns_[p].load() / 1e9 / secs) : 0;
+}
+
+double transfer_metrics::average_rate() const
+{
+   double secs = this->elapsed();
+   return (secs > 0) ? this->bytes() / secs : 0;
+}
+
+double transfer_metrics::current_rate() const
+{
+   if (this->finished())
+      return 0;
+
+   std::lock_guard<std::mutex> guard(this->sample_lock_);
+
+   clock_t::time_point now = clock_t::now();
+   double secs = std::chrono::duration<double>(now - this->sample_time_).count();
+   if (secs >= 1.0)
+   {
+      uint64_t bytes = this->bytes();
+      this->rate_ = (bytes - this->sample_bytes_) / secs;
+      this->sample_bytes_ = bytes;
+      this->sample_time_ = now;
+   }
+
+   // Until a full second has passed the average is as good a guess.
+   return (this->sample_time_ == this->start_) ? this->average_rate() : this->rate_;
+}
+
+void transfer_metrics::print_line(std::ostream & os) const
+{
+   const double mb = double(1 << 20);
+
+   // Formatted apart so os keeps its own flags and precision.
+   std::ostringstream line;
+   line << this->direction_ << ' ' << this->label_ << "  "
+        << std::fixed << std::setprecision(1)
+        << this->bytes() / mb;
+   if (this->total() > 0)
+      line << '/' << this->total() / mb;
+   line << " MB  "
+        << "cur " << this->current_rate() / mb << " MB/s  "
+        << "avg " << this->average_rate() / mb << " MB/s  "
+        << "q " << this->in_flight() << "  "
+        << "rtt " << this->rtt() * 1e3 << " ms  "
+        << std::setprecision(0)
+        << "disk " << this->phase_share(LOCAL_IO) * 100 << "% "
+        << "net " << this->phase_share(NETWORK) * 100 << "% "
+        << "throttle " << this->phase_share(THROTTLE) * 100 << "%";
+
+   os << line.str();
+}
+
+transfer_monitor::transfer_monitor()
+   : quiet_(0),
+     stop_(false),
+     drawn_(false),
+     reporter_(&transfer_monitor::report_routine, this)
+{
+}
+
+transfer_monitor::~transfer_monitor()
+{
+   {
+      std::lock_guard<std::mutex> guard(this->lock_);
+      this->stop_ = true;
+   }
+   this->cv_.notify_all();
+   this->reporter_.join();
+}
+
+metrics_ptr transfer_monitor::begin(const std::string & label, char direction, uint64_t total)
+{
+   metrics_ptr metrics(new transfer_metrics(label, direction, total));
+
+   std::lock_guard<std::mutex> guard(this->lock_);
+   this->active_.push_back(metrics);
+   return metrics;
+}
+
+void transfer_monitor::end(const metrics_ptr & metrics, bool failed)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   metrics->finish(failed);
+   this->reap();
+
+   if (!this->drawn_ || !this->active_.empty())
+      return;
+
+   std::ostringstream line;
+   line << "\r";
+   if (this->shown_ == metrics)
+      metrics->print_line(line);
+   line << "\033[K\n";
+   write(line.str());
+
+   this->drawn_ = false;
+   this->shown_.reset();
+}
+
+std::mutex & transfer_monitor::output_lock()
+{
+   static std::mutex lock;
+   return lock;
+}
+
+void transfer_monitor::write(const std::string & text)
+{
+   std::lock_guard<std::mutex> guard(output_lock());
+   std::cout << text << std::flush;
+}
+
+void transfer_monitor::quiet(bool on)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   if (on)
+      ++this->quiet_;
+   else if (this->quiet_ > 0)
+      --this->quiet_;
+}
+
+void transfer_monitor::reap()
+{
+   for (auto it = this->active_.begin(); it != this->active_.end(); )
+   {
+      if (!(*it)->finished())
+      {
+         ++it;
+         continue;
+      }
+
+      this->history_.push_back(*it);
+      if (this->history_.size() > HISTORY)
+         this->history_.pop_front();
+      it = this->active_.erase(it);
+   }
+}
+
+void transfer_monitor::report_routine()
+{
+   const bool tty = ::isatty(STDOUT_FILENO);
+
+   std::unique_lock<std::mutex> lock(this->lock_);
+   while (!this->stop_)
+   {
+      this->cv_.wait_for(lock, std::chrono::milliseconds(500));
+      this->reap();
+
+      if (!tty || this->quiet_ > 0)
+      {
+         this->drawn_ = false;
+         this->shown_.reset();
+         continue;
+      }
+
+      // end() closes out the line of the last transfer; nothing to draw.
+      if (this->active_.empty())
+         continue;
+
+      std::ostringstream line;
+      line << "\r";
+      if (this->active_.size() == 1)
+      {
+         this->shown_ = this->active_.front();
+         this->shown_->print_line(line);
+      }
+      else
+      {
+         double rate = 0;
+         uint64_t bytes = 0;
+         size_t in_flight = 0;
+         for (auto it = this->active_.begin(); it != this->active_.end(); ++it)
+         {
+            rate += (*it)->current_rate();
+            bytes += (*it)->bytes();
+            in_flight += (*it)->in_flight();
+         }
+
+         const double mb = double(1 << 20);
+         line << this->active_.size() << " transfers  "
+              << std::fixed << std::setprecision(1)
+              << bytes / mb << " MB  " << rate / mb << " MB/s  q " << in_flight;
+         this->shown_.reset();
+      }
+      line << "\033[K";
+
+      write(line.str());
+      this->drawn_ = true;
+   }
+}
+
+void transfer_monitor::print_stats(std::ostream & os)
+{
+   std::lock_guard<std::mutex> guard(this->lock_);
+   this->reap();
+
+   if (this->active_.empty() && this->history_.empty())
+   {
+      os << "No transfers yet." << std::endl;
+      return;
+   }
+
+   for (auto it = this->history_.begin(); it != this->history_.end(); ++it)
+   {
+      std::ostringstream line;
+      (*it)->print_line(line);
+      line << "  " << std::fixed << std::setprecision(1) << (*it)->elapsed() << " s"
+           << ((*it)->failed() ? "  FAILED" : "");
+      os << line.str() << std::endl;
+   }
+
+   for (auto it = this->active_.begin(); it != this->active_.end(); ++it)
+   {
+      (*it)->print_line(os);
+      os << "  running" << std::endl;
+   }
+}
+
+}
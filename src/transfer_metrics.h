@@ -0,0 +1,153 @@
+#ifndef TRANSFER_METRICS_H
+#define TRANSFER_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace charon {
+
+   // Live counters for one transfer, written by the engine moving it and
+   // read concurrently by the progress line and the stats command.
+   class transfer_metrics
+   {
+      public :
+         using clock_t = std::chrono::steady_clock;
+
+         // Where an engine spends the time it isn't busy computing.
+         enum phase
+         {
+            LOCAL_IO = 0,     // reading/writing the local file
+            NETWORK  = 1,     // blocked on the server: replies, ACKs, send window
+            THROTTLE = 2      // queued in the bandwidth scheduler
+         };
+
+      private :
+         struct stopwatch
+         {
+            transfer_metrics &  metrics_;
+            phase               phase_;
+            clock_t::time_point begin_;
+
+            stopwatch(transfer_metrics & metrics, phase p)
+               : metrics_(metrics), phase_(p), begin_(clock_t::now())
+            {}
+
+            ~stopwatch() {this->metrics_.add_time(this->phase_, clock_t::now() - this->begin_);}
+         };
+
+         std::string            label_;
+         char                   direction_;     // '>' upload, '<' download, '=' remote copy
+         clock_t::time_point    start_;
+
+         std::atomic<uint64_t>  total_;
+         std::atomic<uint64_t>  bytes_;
+         std::atomic<size_t>    in_flight_;
+         std::atomic<uint64_t>  rtt_us_;
+         std::atomic<uint64_t>  phase_ns_[3];
+         std::atomic<int64_t>   end_ns_;        // since start_, -1 while running
+         std::atomic<bool>      failed_;
+
+         // Last sample taken for the instantaneous rate.
+         mutable std::mutex     sample_lock_;
+         mutable clock_t::time_point sample_time_;
+         mutable uint64_t       sample_bytes_;
+         mutable double         rate_;
+
+      public :
+
+         transfer_metrics(const std::string & label, char direction, uint64_t total);
+
+         transfer_metrics(const transfer_metrics & rhs) = delete;
+         transfer_metrics & operator=(const transfer_metrics & rhs) = delete;
+
+         // Charges the time fn() takes to phase p.
+         template <typename Fn>
+         auto timed(phase p, Fn fn) -> decltype(fn())
+         {
+            stopwatch sw(*this, p);
+            return fn();
+         }
+
+         void add_time(phase p, clock_t::duration d);
+         void add_bytes(uint64_t bytes) {this->bytes_.fetch_add(bytes);}
+         void set_in_flight(size_t cnt) {this->in_flight_.store(cnt);}
+         void set_rtt(double seconds);
+         void set_total(uint64_t total) {this->total_.store(total);}
+         void finish(bool failed);
+
+         const std::string & label() const {return this->label_;}
+         char     direction() const {return this->direction_;}
+         uint64_t total() const {return this->total_.load();}
+         uint64_t bytes() const {return this->bytes_.load();}
+         size_t   in_flight() const {return this->in_flight_.load();}
+         double   rtt() const {return this->rtt_us_.load() / 1e6;}
+         bool     finished() const {return this->end_ns_.load() >= 0;}
+         bool     failed() const {return this->failed_.load();}
+
+         double   elapsed() const;
+         double   phase_share(phase p) const;    // fraction of elapsed
+         double   average_rate() const;          // bytes/second
+         double   current_rate() const;          // bytes/second, over the last ~second
+
+         void     print_line(std::ostream & os) const;
+   };
+
+   using metrics_ptr = std::shared_ptr<transfer_metrics>;
+
+   // Registry of the transfers a server's connections are running, with
+   // a reporter thread drawing a progress line on a terminal.
+   class transfer_monitor
+   {
+      private :
+         static const size_t HISTORY = 20;
+
+         std::mutex                 lock_;
+         std::condition_variable    cv_;
+         std::vector<metrics_ptr>   active_;
+         std::deque<metrics_ptr>    history_;
+         size_t                     quiet_;
+         bool                       stop_;
+         bool                       drawn_;
+         metrics_ptr                shown_;      // whose line is drawn; null for the summary
+         std::thread                reporter_;
+
+         void report_routine();
+         void reap();
+         static void write(const std::string & text);
+
+      public :
+
+         transfer_monitor();
+         ~transfer_monitor();
+
+         transfer_monitor(const transfer_monitor & rhs) = delete;
+         transfer_monitor & operator=(const transfer_monitor & rhs) = delete;
+
+         metrics_ptr begin(const std::string & label, char direction, uint64_t total);
+
+         // Finishes metrics and, if it was the last transfer running,
+         // closes out the progress line before the caller prints anything.
+         void end(const metrics_ptr & metrics, bool failed);
+
+         // Held by anything writing to stdout while transfers may be
+         // drawing their progress.
+         static std::mutex & output_lock();
+
+         // Callers drawing their own progress (mput/mget) silence ours.
+         void quiet(bool on);
+
+         void print_stats(std::ostream & os);
+   };
+}
+
+#endif // TRANSFER_METRICS_H
@@ -0,0 +1,57 @@
+#ifndef TRANSFER_OPTIONS_H
+#define TRANSFER_OPTIONS_H
+
+#include <cstddef>
+
+namespace charon {
+
+   enum io_backend
+   {
+      IO_PREAD  = 0,    // pread/pwrite, posix_fadvise(SEQUENTIAL)
+      IO_MMAP   = 1,    // mmap + madvise(SEQUENTIAL) for reads
+      IO_URING  = 2,    // io_uring read-ahead / write-behind (needs liburing)
+      IO_DIRECT = 3     // O_DIRECT, bypassing the page cache
+   };
+
+   enum compress_mode
+   {
+      COMPRESS_OFF  = 0,
+      COMPRESS_ON   = 1,
+      COMPRESS_AUTO = 2     // sample each file, compress if it shrinks enough
+   };
+
+   // Tunables shared by the put/get transfer engines.
+   struct transfer_options
+   {
+      static const size_t DEFAULT_CHUNK_SIZE = 256 * (1 << 10);
+      static const size_t DEFAULT_WINDOW     = 64;
+      static const size_t DEFAULT_STRIPES    = 1;
+      static const size_t DEFAULT_WORKERS    = 4;
+
+      size_t chunk_size_;     // (max) bytes per READ/WRITE, before server limits
+      size_t window_;         // max requests in flight per transfer
+      bool   adaptive_;       // size chunk/window from measured RTT and rate
+      size_t stripes_;        // max sessions a single file is split across
+      size_t workers_;        // concurrent files for mput/mget
+      io_backend io_backend_; // local file access for put/get
+      bool   sparse_;         // skip local holes, write zero blocks as holes
+      compress_mode compress_; // zlib transport compression for put/get
+      size_t weight_;         // share of a capped rate, relative to other transfers
+      bool   cp_exec_;        // let cp run cp(1) on the server through a shell
+
+      transfer_options()
+         : chunk_size_(DEFAULT_CHUNK_SIZE),
+           window_(DEFAULT_WINDOW),
+           adaptive_(true),
+           stripes_(DEFAULT_STRIPES),
+           workers_(DEFAULT_WORKERS),
+           io_backend_(IO_PREAD),
+           sparse_(true),
+           compress_(COMPRESS_OFF),
+           weight_(1),
+           cp_exec_(false)
+      {}
+   };
+}
+
+#endif // TRANSFER_OPTIONS_H
@@ -0,0 +1,457 @@
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include "compression_router.h"
+#include "transfer_scheduler.h"
+
+namespace charon {
+
+transfer_scheduler::transfer_scheduler(sftp_server & server, const std::string & user)
+   : server_(server),
+     user_(user),
+     pending_(0),
+     done_(0),
+     found_(0),
+     failed_(0),
+     bytes_(0),
+     resume_(false)
+{
+}
+
+sftp_conn_ptr transfer_scheduler::checkout(const transfer_options & opts, bool compress)
+{
+   sftp_conn_ptr conn = this->server_.checkout(this->user_, compress);
+   conn->set_transfer_options(opts);
+   return conn;
+}
+
+void transfer_scheduler::checkin(const sftp_conn_ptr & conn)
+{
+   this->server_.checkin(conn);
+}
+
+void transfer_scheduler::reset(bool resume)
+{
+   this->pending_ = 0;
+   this->done_ = 0;
+   this->found_.store(0);
+   this->failed_.store(0);
+   this->bytes_.store(0);
+   this->resume_ = resume;
+}
+
+void transfer_scheduler::post(sk3l::concurrent::thread_pool & pool, const std::function<void()> & fn)
+{
+   using sk3l::concurrent::thread_pool_job_base;
+   using sk3l::concurrent::thread_pool_job_rv;
+
+   {
+      std::lock_guard<std::mutex> guard(this->done_lock_);
+      ++this->pending_;
+   }
+
+   pool.post
+   (
+      std::shared_ptr<thread_pool_job_base>
+      (
+         new thread_pool_job_rv<void>
+         (
+            [this, fn]()
+            {
+               try
+               {
+                  fn();
+               }
+               catch (const std::exception & err)
+               {
+                  std::cerr << std::endl << err.what() << std::endl;
+                  this->failed_.fetch_add(1);
+               }
+               catch (...)
+               {
+                  this->failed_.fetch_add(1);
+               }
+
+               std::lock_guard<std::mutex> guard(this->done_lock_);
+               --this->pending_;
+               this->done_cv_.notify_one();
+            }
+         )
+      )
+   );
+}
+
+void transfer_scheduler::wait()
+{
+   auto start = std::chrono::steady_clock::now();
+
+   std::unique_lock<std::mutex> lock(this->done_lock_);
+   for (;;)
+   {
+      bool finished =
+         this->done_cv_.wait_for
+         (
+            lock,
+            std::chrono::milliseconds(500),
+            [this] {return this->pending_ == 0;}
+         );
+
+      double secs =
+         std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      double mbytes = this->bytes_.load() / double(1 << 20);
+
+      std::ostringstream line;
+      line << "\r*--" << this->done_ << "/" << this->found_.load() << " files, "
+           << std::fixed << std::setprecision(1) << mbytes << " MB, "
+           << ((secs > 0) ? mbytes / secs : 0.0) << " MB/s";
+      {
+         std::lock_guard<std::mutex> guard(transfer_monitor::output_lock());
+         std::cout << line.str() << std::flush;
+      }
+
+      if (finished)
+         break;
+   }
+   lock.unlock();
+
+   {
+      std::lock_guard<std::mutex> guard(transfer_monitor::output_lock());
+      std::cout << std::endl;
+   }
+   if (this->failed_.load() > 0)
+      std::cerr << this->failed_.load() << " transfer(s) failed." << std::endl;
+}
+
+void transfer_scheduler::transfer(direction dir, const transfer_item & item, const transfer_options & opts)
+{
+   try
+   {
+      bool compress = false;
+      sftp_conn_ptr conn;
+
+      if (dir == UPLOAD)
+      {
+         compress = compression_router::compress_upload(opts, item.src_);
+         conn = this->checkout(opts, compress);
+         conn->put(item.src_, item.dest_, this->resume_);
+      }
+      else
+      {
+         // Sample over a plain session, then switch if it pays.
+         conn = this->checkout(opts, false);
+         compress = compression_router::compress_download(opts, *conn, item.src_);
+         if (compress)
+         {
+            this->checkin(conn);
+            conn = this->checkout(opts, true);
+         }
+         conn->get(item.src_, item.dest_, this->resume_);
+      }
+
+      this->checkin(conn);
+      this->bytes_.fetch_add(item.size_);
+   }
+   catch (const std::exception & err)
+   {
+      std::cerr << std::endl << item.src_ << ": " << err.what() << std::endl;
+      this->failed_.fetch_add(1);
+   }
+   catch (...)
+   {
+      std::cerr << std::endl << item.src_ << ": transfer failed." << std::endl;
+      this->failed_.fetch_add(1);
+   }
+
+   std::lock_guard<std::mutex> guard(this->done_lock_);
+   ++this->done_;
+}
+
+void transfer_scheduler::run
+(
+   direction dir,
+   const std::vector<transfer_item> & items,
+   const transfer_options & opts
+)
+{
+   using sk3l::concurrent::thread_pool;
+
+   if (items.empty())
+   {
+      std::cerr << "No files matched." << std::endl;
+      return;
+   }
+
+   this->reset(false);
+   this->found_.store(items.size());
+   this->server_.get_monitor().quiet(true);
+
+   size_t workers = (opts.workers_ > 0) ? opts.workers_ : 1;
+   if (workers > items.size())
+      workers = items.size();
+
+   thread_pool pool(workers);
+
+   for (auto it = items.begin(); it != items.end(); ++it)
+   {
+      const transfer_item & item = *it;
+      this->post(pool, [this, dir, &item, &opts]() {this->transfer(dir, item, opts);});
+   }
+
+   this->wait();
+
+   pool.shutdown();
+   this->server_.get_monitor().quiet(false);
+}
+
+void transfer_scheduler::walk_local
+(
+   sk3l::concurrent::thread_pool & pool,
+   const std::string & ldir,
+   const std::string & rdir,
+   const transfer_options & opts
+)
+{
+   sftp_conn_ptr conn = this->checkout(opts, false);
+   conn->make_directory(rdir, true);
+   this->checkin(conn);
+
+   DIR * dir = ::opendir(ldir.c_str());
+   if (dir == nullptr)
+   {
+      std::cerr << std::endl << "Couldn't open local directory '" << ldir << "'" << std::endl;
+      this->failed_.fetch_add(1);
+      return;
+   }
+
+   for (struct dirent * ent = ::readdir(dir); ent != nullptr; ent = ::readdir(dir))
+   {
+      std::string name = ent->d_name;
+      if (name == "." || name == "..")
+         continue;
+
+      std::string lpath = ldir + "/" + name;
+      std::string rpath = rdir + "/" + name;
+
+      struct stat st;
+      if (::lstat(lpath.c_str(), &st) != 0)
+         continue;
+
+      if (S_ISDIR(st.st_mode))
+      {
+         this->post(pool, [this, &pool, lpath, rpath, &opts]() {this->walk_local(pool, lpath, rpath, opts);});
+      }
+      else if (S_ISREG(st.st_mode))
+      {
+         this->found_.fetch_add(1);
+         transfer_item item = {lpath, rpath, static_cast<uint64_t>(st.st_size)};
+         this->post(pool, [this, item, &opts]() {this->transfer(UPLOAD, item, opts);});
+      }
+      else
+         std::cerr << std::endl << "Skipping '" << lpath << "': not a regular file or directory." << std::endl;
+   }
+
+   ::closedir(dir);
+}
+
+void transfer_scheduler::walk_remote
+(
+   sk3l::concurrent::thread_pool & pool,
+   const std::string & rdir,
+   const std::string & ldir,
+   const transfer_options & opts
+)
+{
+   if (::mkdir(ldir.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST)
+   {
+      std::cerr << std::endl << "Couldn't create local directory '" << ldir << "'" << std::endl;
+      this->failed_.fetch_add(1);
+      return;
+   }
+
+   // Transfers start while the rest of the directory is still arriving.
+   sftp_conn_ptr conn = this->checkout(opts, false);
+   try
+   {
+      conn->list_directory
+      (
+         rdir,
+         [this, &pool, &rdir, &ldir, &opts](const sftp_file_ptr & f)
+         {
+            std::string name = f->get_name();
+            if (name == "." || name == "..")
+               return;
+
+            std::string rpath = rdir + "/" + name;
+            std::string lpath = ldir + "/" + name;
+
+            if (f->is_directory())
+            {
+               this->post(pool, [this, &pool, rpath, lpath, &opts]() {this->walk_remote(pool, rpath, lpath, opts);});
+            }
+            else if (f->is_file())
+            {
+               this->found_.fetch_add(1);
+               transfer_item item = {rpath, lpath, f->get_size()};
+               this->post(pool, [this, item, &opts]() {this->transfer(DOWNLOAD, item, opts);});
+            }
+            else
+               std::cerr << std::endl << "Skipping '" << rpath << "': not a regular file or directory." << std::endl;
+         }
+      );
+   }
+   catch (...)
+   {
+      this->checkin(conn);
+      throw;
+   }
+   this->checkin(conn);
+}
+
+void transfer_scheduler::mput(sftp_connection & primary, const std::vector<std::string> & patterns)
+{
+   std::vector<transfer_item> items;
+
+   for (auto it = patterns.begin(); it != patterns.end(); ++it)
+   {
+      glob_t matches;
+      if (::glob(it->c_str(), GLOB_NOCHECK, nullptr, &matches) != 0)
+      {
+         ::globfree(&matches);
+         continue;
+      }
+
+      for (size_t i = 0; i < matches.gl_pathc; ++i)
+      {
+         std::string lpath = matches.gl_pathv[i];
+
+         struct stat st;
+         if (::stat(lpath.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+         {
+            std::cerr << "Skipping '" << lpath << "': not a regular file." << std::endl;
+            continue;
+         }
+
+         items.push_back
+         (
+            {
+               lpath,
+               primary.resolve_path(sftp_connection::base_name(lpath)),
+               static_cast<uint64_t>(st.st_size)
+            }
+         );
+      }
+
+      ::globfree(&matches);
+   }
+
+   this->run(UPLOAD, items, primary.get_transfer_options());
+}
+
+void transfer_scheduler::mget(sftp_connection & primary, const std::vector<std::string> & patterns)
+{
+   std::vector<transfer_item> items;
+
+   for (auto it = patterns.begin(); it != patterns.end(); ++it)
+   {
+      std::string path = primary.resolve_path(*it);
+
+      auto slash = path.find_last_of('/');
+      std::string dir = path.substr(0, slash + 1);
+      std::string pattern = path.substr(slash + 1);
+
+      primary.list_directory
+      (
+         dir,
+         [&items, &dir, &pattern](const sftp_file_ptr & f)
+         {
+            std::string name = f->get_name();
+            if (f->is_file() && ::fnmatch(pattern.c_str(), name.c_str(), FNM_PERIOD) == 0)
+               items.push_back({dir + name, name, f->get_size()});
+         }
+      );
+   }
+
+   this->run(DOWNLOAD, items, primary.get_transfer_options());
+}
+
+void transfer_scheduler::rput
+(
+   sftp_connection & primary,
+   const std::string & lpath,
+   const std::string & rpath,
+   bool resume
+)
+{
+   using sk3l::concurrent::thread_pool;
+
+   std::string src = lpath;
+   while (src.length() > 1 && src[src.length() - 1] == '/')
+      src.erase(src.length() - 1);
+
+   struct stat st;
+   if (::stat(src.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+      throw std::logic_error("Encountered error in put(): '" + lpath + "' is not a local directory");
+
+   std::string dest = primary.resolve_path((rpath.length() > 0) ? rpath : sftp_connection::base_name(src));
+   const transfer_options opts = primary.get_transfer_options();
+
+   this->reset(resume);
+   this->server_.get_monitor().quiet(true);
+
+   {
+      thread_pool pool((opts.workers_ > 0) ? opts.workers_ : 1);
+
+      this->post(pool, [this, &pool, &src, &dest, &opts]() {this->walk_local(pool, src, dest, opts);});
+      this->wait();
+
+      pool.shutdown();
+   }
+   this->server_.get_monitor().quiet(false);
+}
+
+void transfer_scheduler::rget
+(
+   sftp_connection & primary,
+   const std::string & rpath,
+   const std::string & lpath,
+   bool resume
+)
+{
+   using sk3l::concurrent::thread_pool;
+
+   std::string src = primary.resolve_path(rpath);
+   while (src.length() > 1 && src[src.length() - 1] == '/')
+      src.erase(src.length() - 1);
+
+   if (!primary.stat(src).is_directory())
+      throw std::logic_error("Encountered error in get(): '" + rpath + "' is not a remote directory");
+
+   std::string dest = (lpath.length() > 0) ? lpath : sftp_connection::base_name(src);
+   const transfer_options opts = primary.get_transfer_options();
+
+   this->reset(resume);
+   this->server_.get_monitor().quiet(true);
+
+   {
+      thread_pool pool((opts.workers_ > 0) ? opts.workers_ : 1);
+
+      this->post(pool, [this, &pool, &src, &dest, &opts]() {this->walk_remote(pool, src, dest, opts);});
+      this->wait();
+
+      pool.shutdown();
+   }
+   this->server_.get_monitor().quiet(false);
+}
+
+}
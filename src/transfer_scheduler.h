@@ -0,0 +1,100 @@
+#ifndef TRANSFER_SCHEDULER_H
+#define TRANSFER_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "concurrent/thread_pool.h"
+
+#include "sftp_connection.h"
+#include "sftp_server.h"
+
+namespace charon {
+
+   // Runs many independent file transfers on a sk3l thread_pool; each
+   // worker checks a connection out of sftp_server's pool for the file
+   // it moves.
+   // Recursive mirrors walk the tree on the same pool, so listings and
+   // mkdirs overlap with the transfers they feed.
+   class transfer_scheduler
+   {
+      private :
+
+         enum direction
+         {
+            UPLOAD   = 0,
+            DOWNLOAD = 1
+         };
+
+         struct transfer_item
+         {
+            std::string src_;
+            std::string dest_;
+            uint64_t    size_;
+         };
+
+         sftp_server &              server_;
+         std::string                user_;
+
+         std::mutex                 done_lock_;
+         std::condition_variable    done_cv_;
+         size_t                     pending_;   // jobs posted, not yet finished
+         size_t                     done_;      // files finished
+         std::atomic<size_t>        found_;     // files queued so far
+         std::atomic<size_t>        failed_;
+         std::atomic<uint64_t>      bytes_;
+         bool                       resume_;
+
+         sftp_conn_ptr checkout(const transfer_options & opts, bool compress);
+         void          checkin(const sftp_conn_ptr & conn);
+
+         void reset(bool resume);
+         void post(sk3l::concurrent::thread_pool & pool, const std::function<void()> & fn);
+         void wait();
+
+         void transfer(direction dir, const transfer_item & item, const transfer_options & opts);
+
+         void run
+         (
+            direction dir,
+            const std::vector<transfer_item> & items,
+            const transfer_options & opts
+         );
+
+         void walk_local
+         (
+            sk3l::concurrent::thread_pool & pool,
+            const std::string & ldir,
+            const std::string & rdir,
+            const transfer_options & opts
+         );
+         void walk_remote
+         (
+            sk3l::concurrent::thread_pool & pool,
+            const std::string & rdir,
+            const std::string & ldir,
+            const transfer_options & opts
+         );
+
+      public :
+
+         transfer_scheduler(sftp_server & server, const std::string & user);
+
+         transfer_scheduler(const transfer_scheduler & rhs) = delete;
+         transfer_scheduler & operator=(const transfer_scheduler & rhs) = delete;
+
+         void mput(sftp_connection & primary, const std::vector<std::string> & patterns);
+         void mget(sftp_connection & primary, const std::vector<std::string> & patterns);
+
+         // Mirror a directory tree; dest defaults to the source's base name.
+         void rput(sftp_connection & primary, const std::string & lpath, const std::string & rpath = "", bool resume = false);
+         void rget(sftp_connection & primary, const std::string & rpath, const std::string & lpath = "", bool resume = false);
+   };
+}
+
+#endif // TRANSFER_SCHEDULER_H
@@ -0,0 +1,85 @@
+#include <algorithm>
+
+#include "window_controller.h"
+
+namespace charon {
+
+window_controller::window_controller(const transfer_options & opts, uint64_t max_request)
+   : adaptive_(opts.adaptive_),
+     max_chunk_(static_cast<size_t>(std::max<uint64_t>((max_request > 0) ? std::min<uint64_t>(opts.chunk_size_, max_request) : opts.chunk_size_, 1))),
+     max_window_(std::max<size_t>(opts.window_, 1)),
+     chunk_(max_chunk_),
+     window_(static_cast<double>(max_window_)),
+     slow_start_(true),
+     srtt_(0),
+     min_rtt_(0),
+     bandwidth_(0),
+     epoch_bytes_(0),
+     epoch_start_(clock_t::now())
+{
+   if (this->adaptive_)
+   {
+      this->chunk_  = std::min(this->max_chunk_, static_cast<size_t>(START_CHUNK_SIZE));
+      this->window_ = static_cast<double>(std::min(this->max_window_, static_cast<size_t>(START_WINDOW)));
+   }
+}
+
+void window_controller::on_complete(clock_t::duration rtt, size_t bytes)
+{
+   double sample = std::chrono::duration<double>(rtt).count();
+   if (sample <= 0)
+      sample = 1e-6;
+
+   this->srtt_ = (this->srtt_ == 0) ? sample : 0.875 * this->srtt_ + 0.125 * sample;
+   if (this->min_rtt_ == 0 || sample < this->min_rtt_)
+      this->min_rtt_ = sample;
+
+   this->epoch_bytes_ += bytes;
+
+   clock_t::time_point now = clock_t::now();
+   double elapsed = std::chrono::duration<double>(now - this->epoch_start_).count();
+
+   // One adjustment per smoothed round trip.
+   if (elapsed >= std::max(this->srtt_, 0.001))
+      this->end_epoch(now);
+}
+
+void window_controller::end_epoch(clock_t::time_point now)
+{
+   double elapsed = std::chrono::duration<double>(now - this->epoch_start_).count();
+   double rate = this->epoch_bytes_ / elapsed;
+
+   this->bandwidth_ = (this->bandwidth_ == 0) ? rate : 0.75 * this->bandwidth_ + 0.25 * rate;
+   this->epoch_bytes_ = 0;
+   this->epoch_start_ = now;
+
+   if (!this->adaptive_)
+      return;
+
+   // Sub-millisecond jitter on a LAN isn't queueing.
+   bool queueing =
+      (this->srtt_ > 2 * this->min_rtt_) && (this->srtt_ - this->min_rtt_ > 0.001);
+
+   if (queueing)
+   {
+      this->slow_start_ = false;
+      this->window_ = std::max<double>(MIN_WINDOW, this->window_ / 2);
+   }
+   else if (this->slow_start_)
+      this->window_ = std::min<double>(this->max_window_, this->window_ * 2);
+   else
+      this->window_ = std::min<double>(this->max_window_, this->window_ + 1);
+
+   // Size chunks so the window spans twice the bandwidth-delay product,
+   // rounded up to a power of two.
+   double bdp = this->bandwidth_ * this->min_rtt_;
+   size_t target = static_cast<size_t>(2 * bdp / this->window_);
+
+   size_t chunk = MIN_CHUNK_SIZE;
+   while (chunk < target && chunk < this->max_chunk_)
+      chunk <<= 1;
+
+   this->chunk_ = std::min(chunk, this->max_chunk_);
+}
+
+}
@@ -0,0 +1,63 @@
+#ifndef WINDOW_CONTROLLER_H
+#define WINDOW_CONTROLLER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "transfer_options.h"
+
+namespace charon {
+
+   // Sizes a transfer's requests and the number kept in flight from the
+   // round-trip times and ACK throughput it observes.
+   //
+   // The window opens exponentially until the first sign of queueing (the
+   // smoothed RTT reaching twice the floor), then grows by one request per
+   // RTT and halves whenever queueing reappears.  Chunks are sized so the
+   // window covers twice the measured bandwidth-delay product.  With
+   // adaptive_ off, the configured chunk/window are used as-is.
+   class window_controller
+   {
+      private :
+         using clock_t = std::chrono::steady_clock;
+
+         static const size_t MIN_CHUNK_SIZE = 16 * (1 << 10);
+         static const size_t START_CHUNK_SIZE = 32 * (1 << 10);
+         static const size_t MIN_WINDOW     = 2;
+         static const size_t START_WINDOW   = 8;
+
+         bool     adaptive_;
+         size_t   max_chunk_;
+         size_t   max_window_;
+
+         size_t   chunk_;
+         double   window_;
+         bool     slow_start_;
+
+         double   srtt_;          // seconds
+         double   min_rtt_;       // seconds
+         double   bandwidth_;     // bytes/second
+
+         uint64_t             epoch_bytes_;
+         clock_t::time_point  epoch_start_;
+
+         void end_epoch(clock_t::time_point now);
+
+      public :
+
+         // max_request is the server's cap on a single READ/WRITE; 0 for none.
+         window_controller(const transfer_options & opts, uint64_t max_request);
+
+         size_t chunk_size() const {return this->chunk_;}
+         size_t window() const {return static_cast<size_t>(this->window_);}
+         size_t max_chunk_size() const {return this->max_chunk_;}
+
+         double rtt() const {return this->srtt_;}
+         double bandwidth() const {return this->bandwidth_;}
+
+         void on_complete(clock_t::duration rtt, size_t bytes);
+   };
+}
+
+#endif // WINDOW_CONTROLLER_H